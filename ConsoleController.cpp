@@ -5,227 +5,2372 @@
 
 #include "ConsoleController.h"
 
+#include <algorithm>          //buffer fills and clamping
+#include <atomic>             //input queue
+#include <cerrno>             //signal handlers
+#include <chrono>             //input timeouts
+#include <condition_variable> //input queue
+#include <cstdint>            //width table
+#include <cstdio>             //escape sequence formatting
+#include <cstdlib>            //output buffer allocation
+#include <cstring>            //output buffer copies
+#include <deque>              //decoded keys
+#include <mutex>              //input queue, cluster pool
+#include <new>                //aligned screen buffers
+#include <thread>             //input queue
+#include <vector>             //key sequence trie, cluster pool
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CONSOLECONTROLLER_X86_64 //SSE2 is always there, AVX2 is checked for at runtime
+#include <immintrin.h> //row comparison
+#ifdef _MSC_VER
+#include <intrin.h>    //cpu feature checks
+#endif
+#endif
+
+#ifndef _WIN32
+#include <poll.h>      //key reads with timeouts
+#include <unistd.h>    //raw key reads
+#endif
+#ifndef _WIN32
+#include <sys/ioctl.h> //window size
+#endif
+#ifdef CONSOLECONTROLLER_CURSES
+#include <clocale>     //UTF-8 output
+#endif
+
 //static init
 int ConsoleController::classInstances = 0;
+ConsoleController::INPUT_QUEUE* ConsoleController::inputQueue = NULL;
+ConsoleController::PLANES ConsoleController::backBuffer = {NULL, NULL, NULL};
+ConsoleController::PLANES ConsoleController::frontBuffer = {NULL, NULL, NULL};
+int ConsoleController::bufferStride = 0;
+ConsoleController::SPAN* ConsoleController::dirtySpans = NULL;
+ConsoleController::COORD_2D ConsoleController::bufferSize = {0, 0};
+ConsoleController::COORD_2D ConsoleController::cursorPos = {0, 0};
+ConsoleController::COLOR_ID ConsoleController::activeColor = 0;
+ConsoleController::UTF8_STATE ConsoleController::utf8State = {0, 0, 0};
+ConsoleController::CLUSTER_POOL* ConsoleController::clusterPool = NULL;
+ConsoleController::COORD_2D ConsoleController::termCursor = {-1, -1};
+int ConsoleController::termColor = -1;
+int ConsoleController::pendingClear = -1;
+int ConsoleController::frameDepth = 0;
+ConsoleController::SCROLL ConsoleController::pendingScrolls[ConsoleController::MAX_PENDING_SCROLLS];
+int ConsoleController::pendingScrollCount = 0;
+ConsoleController::COLOR ConsoleController::colors[256];
+ConsoleController::ColorDepth ConsoleController::colorDepth = ConsoleController::DEPTH_16_COLORS;
+
+#ifndef CONSOLECONTROLLER_CURSES
+char* ConsoleController::outBuffer = NULL;
+size_t ConsoleController::outLength = 0;
+size_t ConsoleController::outCapacity = 64 * 1024;
+#endif
 
 #ifdef _WIN32
 HANDLE ConsoleController::hStdout;
-ConsoleController::COLOR ConsoleController::colors[256];
+bool ConsoleController::consoleOutput;
+WORD ConsoleController::colorAttributes[256];
+WORD ConsoleController::defaultAttributes;
+UINT ConsoleController::savedOutputCP;
+#elif defined(CONSOLECONTROLLER_ANSI)
+ConsoleController::SGR_CODE ConsoleController::sgrCodes[256];
+termios ConsoleController::savedTermios;
+#ifndef CONSOLECONTROLLER_HEADLESS
+termios ConsoleController::rawTermios;
+volatile sig_atomic_t ConsoleController::resumed = 0;
+#endif
+bool ConsoleController::syncUpdates = false;
+bool ConsoleController::syncOpen = false;
+#ifdef CONSOLECONTROLLER_HEADLESS
+ConsoleController::COORD_2D ConsoleController::headlessSize = {80, 24};
+#endif
 #else
-bool ConsoleController::foreBoldFlags[256];
+attr_t ConsoleController::colorAttributes[256];
+bool ConsoleController::syncUpdates = false;
 #endif // _WIN32
 
-//local functions
-#ifndef _WIN32
-int posix_translateKey();
-#endif // _WIN32
+#ifndef CONSOLECONTROLLER_NO_GLOBAL
+//after the statics above, so they are all set up before the console is taken over
+ConsoleController con;
+#endif
+
+//local functions
+#ifdef _WIN32
+bool windows_waitForKey(long timeoutMs, HANDLE wake);
+int windows_translateKey();
+#else
+ConsoleController::ColorDepth posix_probeColorDepth();
+#if defined(CONSOLECONTROLLER_ANSI) && !defined(CONSOLECONTROLLER_HEADLESS)
+bool posix_probeSyncUpdates();
+#endif
+bool posix_readInput(long timeoutMs);
+bool posix_inputEnded();
+bool posix_nextKey(int& key);
+long posix_escapeWait();
+void posix_expireEscape();
+int posix_translateKey(long timeoutMs);
+#endif // _WIN32
+
+#ifdef CONSOLECONTROLLER_ANSI
+//alternate screen, no autowrap so writing the bottom-right cell can't scroll, and bracketed
+//paste so pasted text can be told apart from typed keys; then all of it undone again
+static const char TERMINAL_SETUP[] = "\x1b[?1049h\x1b[?7l\x1b[?2004h";
+static const char TERMINAL_RESET[] = "\x1b[?2026l\x1b[0m\x1b[?2004l\x1b[?7h\x1b[?1049l";
+#endif
+
+//keys read by the input thread, handed to the main thread through a single-producer,
+//single-consumer ring so that neither side ever takes a lock to pass a key along
+struct ConsoleController::INPUT_QUEUE {
+	static const size_t CAPACITY = 256;
+
+	KEY_EVENT events[CAPACITY];
+	std::atomic<size_t> head{0}; //only ever written by the input thread
+	std::atomic<size_t> tail{0}; //only ever written by the consumer
+	std::atomic<bool> running{true};
+	std::atomic<bool> ended{false}; //the reader stopped at the end of input, so no more keys will come
+
+	//only used to sleep in waitEvent() when the ring is empty
+	std::mutex waitMutex;
+	std::condition_variable waitCond;
+
+	std::thread thread;
+#ifdef _WIN32
+	HANDLE wakeEvent; //set by stopInputThread() to interrupt the reader's wait
+#else
+	int wakePipe[2]; //written to by stopInputThread() to interrupt the reader's poll()
+#endif
+
+	bool push(const KEY_EVENT& event) {
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h - tail.load(std::memory_order_acquire) == CAPACITY)
+			return false;
+		events[h % CAPACITY] = event;
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool pop(KEY_EVENT& event) {
+		size_t t = tail.load(std::memory_order_relaxed);
+		if (t == head.load(std::memory_order_acquire))
+			return false;
+		event = events[t % CAPACITY];
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	//a negative timeout waits forever
+	bool wait(KEY_EVENT& event, long timeoutMs) {
+		if (pop(event))
+			return true;
+		if (timeoutMs == 0)
+			return false;
+
+		std::unique_lock<std::mutex> lock(waitMutex);
+		bool popped = false;
+		auto ready = [&] { return (popped = pop(event)) || ended.load(); };
+		if (timeoutMs < 0)
+			waitCond.wait(lock, ready);
+		else
+			waitCond.wait_for(lock, std::chrono::milliseconds(timeoutMs), ready);
+		return popped;
+	}
+
+	void run() {
+		KEY_EVENT event;
+#ifndef _WIN32
+		//keys decoded before the thread started come first
+		while (posix_nextKey(event.key))
+			if (!deliver(event))
+				return;
+#endif
+
+		while (running.load()) {
+#ifdef _WIN32
+			//_getch() can't be interrupted, so only call it once a key is known to be waiting
+			if (!windows_waitForKey(-1, wakeEvent))
+				break;
+			event.key = windows_translateKey();
+			if (!deliver(event))
+				return;
+#else
+			//only wake up early to give up on a half-received escape sequence
+			pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {wakePipe[0], POLLIN, 0}};
+			int ready = poll(fds, 2, (int) posix_escapeWait());
+			if (ready < 0)
+				continue; //interrupted by a signal
+			if (fds[1].revents)
+				break;
+			if (ready > 0)
+				posix_readInput(0);
+			else
+				posix_expireEscape();
+
+			//one read can hold a whole burst of keys, e.g. a paste
+			while (posix_nextKey(event.key))
+				if (!deliver(event))
+					return;
+			if (posix_inputEnded())
+				break;
+#endif
+		}
+
+		//wakes anyone waiting for a key that will never come
+		{
+			std::lock_guard<std::mutex> lock(waitMutex);
+			ended.store(true);
+		}
+		waitCond.notify_all();
+	}
+
+	bool deliver(const KEY_EVENT& event) {
+		//a full ring means the consumer is behind; wait for room instead of dropping keys
+		while (!push(event)) {
+			if (!running.load())
+				return false;
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+		{
+			std::lock_guard<std::mutex> lock(waitMutex); //so a waiter can't miss the wakeup
+		}
+		waitCond.notify_one();
+		return true;
+	}
+};
+
+//characters made of several code points, which cells refer to by handle; each cluster is
+//only stored once, so comparing glyphs still compares what the cells show
+struct ConsoleController::CLUSTER_POOL {
+	static const size_t INITIAL_CLUSTERS = 256;
+	static const size_t MAX_CLUSTERS = 1 << 20; //keeps handles well clear of UNKNOWN_GLYPH
+
+	struct CLUSTER {
+		char32_t codepoints[MAX_CLUSTER_LENGTH];
+		int length;              //0 while the slot is free
+		unsigned int generation; //when it was last interned or found in use by a sweep
+	};
+
+	std::vector<CLUSTER> clusters;   //fixed-size slots, so a handle is just an index
+	std::vector<unsigned int> table; //open addressing over clusters, slot + 1 or 0 when empty
+	size_t nextFree = 0;             //every slot before this is in use
+	unsigned int generation = 1;     //moved on by each frame and each sweep
+	unsigned int frameGeneration = 1; //where the frame being drawn started
+
+	//output into separate views may come from several threads at once
+	std::mutex mutex;
+
+	CLUSTER_POOL() : clusters(INITIAL_CLUSTERS) {
+		rebuildTable();
+	}
+
+	static size_t hash(const char32_t* codepoints, int length) {
+		size_t h = 2166136261u;
+		for (int i = 0; i < length; ++i)
+			h = (h ^ codepoints[i]) * 16777619u;
+		return h;
+	}
+
+	//the table slot holding this cluster, or the empty one it would go in
+	size_t find(const char32_t* codepoints, int length) {
+		size_t mask = table.size() - 1;
+		size_t i = hash(codepoints, length) & mask;
+		for (; table[i] != 0; i = (i + 1) & mask) {
+			const CLUSTER& cluster = clusters[table[i] - 1];
+			if (cluster.length == length && std::equal(codepoints, codepoints + length, cluster.codepoints))
+				break;
+		}
+		return i;
+	}
+
+	//kept at no more than half full, so probes stay short
+	void rebuildTable() {
+		table.assign(clusters.size() * 2, 0);
+		for (size_t slot = 0; slot < clusters.size(); ++slot)
+			if (clusters[slot].length != 0)
+				table[find(clusters[slot].codepoints, clusters[slot].length)] = (unsigned int) slot + 1;
+	}
+
+	//clusters interned from here on are kept until the frame after, since the cells they
+	//are meant for may not have been written yet when a sweep comes along
+	void startFrame() {
+		std::lock_guard<std::mutex> lock(mutex);
+		frameGeneration = ++generation;
+	}
+
+	bool nextFreeSlot() {
+		while (nextFree < clusters.size() && clusters[nextFree].length != 0)
+			++nextFree;
+		return nextFree < clusters.size();
+	}
+};
+
+/////////////////////////////////////////////////
+
+ConsoleController::ConsoleController() {
+	// Only setup the console on the first allocation
+	// since this must be done only once until the last destruction
+	if (classInstances == 0) {
+#ifndef CONSOLECONTROLLER_CURSES
+		outBuffer = (char*) malloc(outCapacity);
+		outLength = 0;
+#endif
+
+#ifdef _WIN32
+		hStdout = GetStdHandle(STD_OUTPUT_HANDLE);
+		DWORD mode;
+		consoleOutput = GetConsoleMode(hStdout, &mode) != 0;
+
+		//the console's own color is whatever it was using when we got it
+		CONSOLE_SCREEN_BUFFER_INFO csbi;
+		GetConsoleScreenBufferInfo(hStdout, &csbi);
+		defaultAttributes = csbi.wAttributes & 0xFF;
+		savedOutputCP = GetConsoleOutputCP();
+		SetConsoleOutputCP(CP_UTF8); //output is sent as UTF-8
+		ColorDepth depth = DEPTH_16_COLORS;
+#elif defined(CONSOLECONTROLLER_ANSI)
+#ifndef CONSOLECONTROLLER_HEADLESS
+		//the same terminal modes curses' cbreak() and noecho() would give us
+		tcgetattr(STDIN_FILENO, &savedTermios);
+		termios raw = savedTermios;
+		raw.c_lflag &= ~(ICANON | ECHO);
+		raw.c_oflag &= ~OPOST; //we send our own \r, so don't let the tty turn \n into \r\n
+		raw.c_cc[VMIN] = 1;
+		raw.c_cc[VTIME] = 0;
+		tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+		rawTermios = raw;
+
+		//curses gives the terminal back when the program is interrupted, killed or
+		//suspended, or exits without destroying us, and so do we
+		catchSignals(true);
+		static bool atExitSet = false;
+		if (!atExitSet)
+			atexit(restoreAtExit);
+		atExitSet = true;
+#endif
+
+		appendOutput(TERMINAL_SETUP);
+		ColorDepth depth = posix_probeColorDepth();
+#ifndef CONSOLECONTROLLER_HEADLESS
+		flush();
+		syncUpdates = posix_probeSyncUpdates();
+#endif
+#else
+		//curses only writes UTF-8 when the locale says to, so pick up the user's unless
+		//the program already chose one
+		if (strcmp(setlocale(LC_CTYPE, NULL), "C") == 0)
+			setlocale(LC_CTYPE, "");
+		initscr();
+		cbreak();
+		noecho();
+		keypad(stdscr, true);
+		typeahead(-1); //input is read from the tty directly, see posix_readInput()
+		fputs("\x1b[?2004h", stdout); //bracketed paste, which curses has no call for
+		fflush(stdout);
+		start_color();
+		use_default_colors(); //makes -1 the terminal's own color
+
+		//terminals only list Sync when they take the DEC mode 2026 sequences the ANSI backend uses
+		char* sync = tigetstr((char*) "Sync");
+		syncUpdates = sync != NULL && sync != (char*) -1;
+		ColorDepth depth = DEPTH_256_COLORS; //as far as COLORS allows, see setColorDepth()
+#endif
+
+		//every color starts out as the console's own, so programs that never call
+		//initColor() still get readable text
+		COLOR defaultColor = {-1, -1, false};
+		std::fill(colors, colors + 256, defaultColor);
+		setColorDepth(depth);
+
+		bufferSize = consoleSize();
+		allocateBuffers();
+		activeColor = 0;
+
+		//whatever the console's cursor and color are now, we can't rely on them
+		termCursor = {-1, -1};
+		termColor = -1;
+		clearTerminal(0);
+		flush();
+    }
+
+    ++classInstances;
+}
+
+ConsoleController::~ConsoleController(void) {
+	--classInstances;
+	if (classInstances == 0) {
+		stopInputThread();
+		frameDepth = 0;
+		cls();
+		present();
+
+#if defined(CONSOLECONTROLLER_HEADLESS)
+		appendOutput(TERMINAL_RESET);
+		flush();
+#elif defined(CONSOLECONTROLLER_ANSI)
+		flush();
+		catchSignals(false);
+		restoreTerminal();
+#elif defined(CONSOLECONTROLLER_CURSES)
+		fputs("\x1b[?2004l", stdout);
+		fflush(stdout);
+		endwin();
+#else
+		SetConsoleOutputCP(savedOutputCP);
+#endif
+#ifndef CONSOLECONTROLLER_CURSES
+		free(outBuffer);
+		outBuffer = NULL;
+		outLength = 0;
+#endif
+		freeBuffers();
+	}
+}
+
+void ConsoleController::initColor(COLOR_ID colorId, int fg, int bg, bool fBold, bool bBold) {
+	COLOR newColor = {fg, bg >= 0 && bBold ? bg + 8 : bg, fBold}; //+8 is the bright version
+	colors[colorId] = newColor;
+	compileColor(colorId);
+}
+
+void ConsoleController::initColor(COLOR_ID colorId, int fg, int bg) {
+	COLOR newColor = {fg, bg, false};
+	colors[colorId] = newColor;
+	compileColor(colorId);
+}
+
+ConsoleController::ColorDepth ConsoleController::getColorDepth() {
+	return colorDepth;
+}
+
+void ConsoleController::setColorDepth(ColorDepth depth) {
+#ifdef _WIN32
+	depth = DEPTH_16_COLORS; //all the console API has
+#elif defined(CONSOLECONTROLLER_CURSES)
+	//curses has no way to send RGB, and its palette is only as big as the terminal's
+	depth = COLORS >= 256 ? std::min(depth, DEPTH_256_COLORS) : DEPTH_16_COLORS;
+#endif
+	colorDepth = depth;
+	for (int i = 0; i < 256; i++)
+		compileColor(i);
+}
+
+// Color quantization
+//the xterm palette that 256-color terminals share: 16 basic colors (whose exact shades
+//vary between terminals), a 6x6x6 cube and a 24-step gray ramp
+static const int cubeLevels[6] = {0, 95, 135, 175, 215, 255};
+static const unsigned char basicColors[16][3] = {
+	{0, 0, 0},       {205, 0, 0},     {0, 205, 0},     {205, 205, 0},
+	{0, 0, 238},     {205, 0, 205},   {0, 205, 205},   {229, 229, 229},
+	{127, 127, 127}, {255, 0, 0},     {0, 255, 0},     {255, 255, 0},
+	{92, 92, 255},   {255, 0, 255},   {0, 255, 255},   {255, 255, 255}
+};
+
+static int paletteRgb(int index) {
+	if (index < 16)
+		return ConsoleController::rgb(basicColors[index][0], basicColors[index][1], basicColors[index][2]);
+	if (index < 232) {
+		index -= 16;
+		return ConsoleController::rgb(cubeLevels[index / 36], cubeLevels[index / 6 % 6], cubeLevels[index % 6]);
+	}
+	int gray = 8 + (index - 232) * 10;
+	return ConsoleController::rgb(gray, gray, gray);
+}
+
+//squared distance, weighted roughly by how sensitive the eye is to each channel
+static int colorDistance(int rgb1, int rgb2) {
+	int dr = (rgb1 >> 16 & 0xFF) - (rgb2 >> 16 & 0xFF);
+	int dg = (rgb1 >> 8 & 0xFF) - (rgb2 >> 8 & 0xFF);
+	int db = (rgb1 & 0xFF) - (rgb2 & 0xFF);
+	return 2 * dr * dr + 4 * dg * dg + 3 * db * db;
+}
+
+//nearest of the cube and gray ramp entries, worked out directly since both are regular
+static int nearest256(int color) {
+	int r = color >> 16 & 0xFF, g = color >> 8 & 0xFF, b = color & 0xFF;
+
+	//each channel snaps to its closest cube level on its own
+	auto level = [](int v) { return v < 48 ? 0 : v < 115 ? 1 : (v - 35) / 40; };
+	int cube = 16 + 36 * level(r) + 6 * level(g) + level(b);
+	int gray = 232 + std::min(23, std::max(0, ((r + g + b) / 3 - 3) / 10));
+
+	return colorDistance(color, paletteRgb(gray)) < colorDistance(color, paletteRgb(cube)) ? gray : cube;
+}
+
+//nearest of the 16 basic colors, looked up in a 32x32x32 cube filled in on first use
+//so that a search through the palette only ever happens once per cube cell
+static int nearest16(int color) {
+	static const struct NEAREST_CUBE {
+		unsigned char index[32 * 32 * 32];
+
+		NEAREST_CUBE() {
+			for (int i = 0; i < 32 * 32 * 32; ++i) {
+				//the middle of the cell, in 8-bit channels
+				int center = ConsoleController::rgb((i >> 10) * 8 + 4, (i >> 5 & 31) * 8 + 4, (i & 31) * 8 + 4);
+				int best = 0;
+				for (int c = 1; c < 16; ++c)
+					if (colorDistance(center, paletteRgb(c)) < colorDistance(center, paletteRgb(best)))
+						best = c;
+				index[i] = (unsigned char) best;
+			}
+		}
+	} cube;
+	return cube.index[(color >> 19 & 31) << 10 | (color >> 11 & 31) << 5 | (color >> 3 & 31)];
+}
+
+//brings a color value (see initColor()) within what a console of the given depth can show:
+//RGB only stays RGB with truecolor, and palette entries past 15 need 256 colors
+static int reduceColor(int color, ConsoleController::ColorDepth depth) {
+	if (color < 0)
+		return -1;
+	if (color & ConsoleController::RGB_FLAG) {
+		if (depth == ConsoleController::DEPTH_TRUECOLOR)
+			return color;
+		return depth == ConsoleController::DEPTH_256_COLORS ? nearest256(color) : nearest16(color);
+	}
+	color &= 0xFF;
+	if (color < 16 || depth != ConsoleController::DEPTH_16_COLORS)
+		return color;
+	return nearest16(paletteRgb(color));
+}
+
+#ifdef CONSOLECONTROLLER_ANSI
+//appends the SGR parameters for one color; base is 30 for foreground, 40 for background
+static int formatSgrColor(char* buf, size_t size, int color, int base) {
+	if (color < 0)
+		return 0; //left at the terminal's own color by the reset
+	if (color & ConsoleController::RGB_FLAG)
+		return snprintf(buf, size, ";%d;2;%d;%d;%d", base + 8, color >> 16 & 0xFF, color >> 8 & 0xFF, color & 0xFF);
+	if (color >= 16)
+		return snprintf(buf, size, ";%d;5;%d", base + 8, color);
+	if (color >= 8)
+		return snprintf(buf, size, ";%d", base + 60 + color - 8); //90-97 and 100-107
+	return snprintf(buf, size, ";%d", base + color);
+}
+#endif
+
+//everything the console needs to switch to a color is worked out here, once,
+//so that changing colors while presenting is just a table lookup
+void ConsoleController::compileColor(COLOR_ID colorId) {
+	const COLOR& c = colors[colorId];
+	int fg = reduceColor(c.foreground, colorDepth);
+	int bg = reduceColor(c.background, colorDepth);
+
+#ifdef _WIN32
+	//palette colors are red, green, blue and bright bits, just in a different order
+	auto bits = [](int i) {
+		return (WORD) ((i & 1 ? FOREGROUND_RED : 0) | (i & 2 ? FOREGROUND_GREEN : 0) |
+			(i & 4 ? FOREGROUND_BLUE : 0) | (i & 8 ? FOREGROUND_INTENSITY : 0));
+	};
+	WORD attributes = fg < 0 ? defaultAttributes & 0x0F : bits(fg);
+	attributes |= bg < 0 ? defaultAttributes & 0xF0 : bits(bg) << 4; //background bits are the same, shifted
+	if (c.bold)
+		attributes |= FOREGROUND_INTENSITY;
+	colorAttributes[colorId] = attributes;
+#elif defined(CONSOLECONTROLLER_ANSI)
+	//reset, then bold, foreground and background
+	SGR_CODE& code = sgrCodes[colorId];
+	int n = snprintf(code.bytes, sizeof code.bytes, "\x1b[0");
+	if (c.bold)
+		n += snprintf(code.bytes + n, sizeof code.bytes - n, ";1");
+	n += formatSgrColor(code.bytes + n, sizeof code.bytes - n, fg, 30);
+	n += formatSgrColor(code.bytes + n, sizeof code.bytes - n, bg, 40);
+	n += snprintf(code.bytes + n, sizeof code.bytes - n, "m");
+	code.length = (unsigned char) n;
+#else
+	//terminals with only 8 colors lose the bright half
+	if (fg >= COLORS)
+		fg &= 7;
+	if (bg >= COLORS)
+		bg &= 7;
+	if (colorId + 1 < COLOR_PAIRS)
+		init_pair(colorId + 1, fg, bg);
+	colorAttributes[colorId] = COLOR_PAIR(colorId + 1) | (c.bold ? A_BOLD : 0);
+#endif
+
+	//the console may be showing the old version of this color
+	if (colorId == termColor)
+		termColor = -1;
+}
+
+/////////////////////////////////////////////////
+
+// Character widths
+//every character that isn't one cell wide, from the Unicode 14.0 data: nonspacing and enclosing
+//marks, format characters and Hangul medial/final jamo take none, East Asian Wide and
+//Fullwidth characters (CJK, Hangul syllables, emoji, ...) take two; unassigned code points
+//next to a range are folded into it
+struct WIDTH_RANGE {
+	char32_t first, last;
+	int width;
+};
+
+static constexpr WIDTH_RANGE widthRanges[] = {
+	{0x0300, 0x036F, 0}, {0x0483, 0x0489, 0}, {0x0591, 0x05BD, 0}, {0x05BF, 0x05BF, 0}, {0x05C1, 0x05C2, 0},
+	{0x05C4, 0x05C5, 0}, {0x05C7, 0x05C7, 0}, {0x0600, 0x0605, 0}, {0x0610, 0x061A, 0}, {0x061C, 0x061C, 0},
+	{0x064B, 0x065F, 0}, {0x0670, 0x0670, 0}, {0x06D6, 0x06DD, 0}, {0x06DF, 0x06E4, 0}, {0x06E7, 0x06E8, 0},
+	{0x06EA, 0x06ED, 0}, {0x070F, 0x070F, 0}, {0x0711, 0x0711, 0}, {0x0730, 0x074A, 0}, {0x07A6, 0x07B0, 0},
+	{0x07EB, 0x07F3, 0}, {0x07FD, 0x07FD, 0}, {0x0816, 0x0819, 0}, {0x081B, 0x0823, 0}, {0x0825, 0x0827, 0},
+	{0x0829, 0x082D, 0}, {0x0859, 0x085B, 0}, {0x0890, 0x089F, 0}, {0x08CA, 0x0902, 0}, {0x093A, 0x093A, 0},
+	{0x093C, 0x093C, 0}, {0x0941, 0x0948, 0}, {0x094D, 0x094D, 0}, {0x0951, 0x0957, 0}, {0x0962, 0x0963, 0},
+	{0x0981, 0x0981, 0}, {0x09BC, 0x09BC, 0}, {0x09C1, 0x09C4, 0}, {0x09CD, 0x09CD, 0}, {0x09E2, 0x09E3, 0},
+	{0x09FE, 0x0A02, 0}, {0x0A3C, 0x0A3C, 0}, {0x0A41, 0x0A51, 0}, {0x0A70, 0x0A71, 0}, {0x0A75, 0x0A75, 0},
+	{0x0A81, 0x0A82, 0}, {0x0ABC, 0x0ABC, 0}, {0x0AC1, 0x0AC8, 0}, {0x0ACD, 0x0ACD, 0}, {0x0AE2, 0x0AE3, 0},
+	{0x0AFA, 0x0B01, 0}, {0x0B3C, 0x0B3C, 0}, {0x0B3F, 0x0B3F, 0}, {0x0B41, 0x0B44, 0}, {0x0B4D, 0x0B56, 0},
+	{0x0B62, 0x0B63, 0}, {0x0B82, 0x0B82, 0}, {0x0BC0, 0x0BC0, 0}, {0x0BCD, 0x0BCD, 0}, {0x0C00, 0x0C00, 0},
+	{0x0C04, 0x0C04, 0}, {0x0C3C, 0x0C3C, 0}, {0x0C3E, 0x0C40, 0}, {0x0C46, 0x0C56, 0}, {0x0C62, 0x0C63, 0},
+	{0x0C81, 0x0C81, 0}, {0x0CBC, 0x0CBC, 0}, {0x0CBF, 0x0CBF, 0}, {0x0CC6, 0x0CC6, 0}, {0x0CCC, 0x0CCD, 0},
+	{0x0CE2, 0x0CE3, 0}, {0x0D00, 0x0D01, 0}, {0x0D3B, 0x0D3C, 0}, {0x0D41, 0x0D44, 0}, {0x0D4D, 0x0D4D, 0},
+	{0x0D62, 0x0D63, 0}, {0x0D81, 0x0D81, 0}, {0x0DCA, 0x0DCA, 0}, {0x0DD2, 0x0DD6, 0}, {0x0E31, 0x0E31, 0},
+	{0x0E34, 0x0E3A, 0}, {0x0E47, 0x0E4E, 0}, {0x0EB1, 0x0EB1, 0}, {0x0EB4, 0x0EBC, 0}, {0x0EC8, 0x0ECD, 0},
+	{0x0F18, 0x0F19, 0}, {0x0F35, 0x0F35, 0}, {0x0F37, 0x0F37, 0}, {0x0F39, 0x0F39, 0}, {0x0F71, 0x0F7E, 0},
+	{0x0F80, 0x0F84, 0}, {0x0F86, 0x0F87, 0}, {0x0F8D, 0x0FBC, 0}, {0x0FC6, 0x0FC6, 0}, {0x102D, 0x1030, 0},
+	{0x1032, 0x1037, 0}, {0x1039, 0x103A, 0}, {0x103D, 0x103E, 0}, {0x1058, 0x1059, 0}, {0x105E, 0x1060, 0},
+	{0x1071, 0x1074, 0}, {0x1082, 0x1082, 0}, {0x1085, 0x1086, 0}, {0x108D, 0x108D, 0}, {0x109D, 0x109D, 0},
+	{0x1100, 0x115F, 2}, {0x1160, 0x11FF, 0}, {0x135D, 0x135F, 0}, {0x1712, 0x1714, 0}, {0x1732, 0x1733, 0},
+	{0x1752, 0x1753, 0}, {0x1772, 0x1773, 0}, {0x17B4, 0x17B5, 0}, {0x17B7, 0x17BD, 0}, {0x17C6, 0x17C6, 0},
+	{0x17C9, 0x17D3, 0}, {0x17DD, 0x17DD, 0}, {0x180B, 0x180F, 0}, {0x1885, 0x1886, 0}, {0x18A9, 0x18A9, 0},
+	{0x1920, 0x1922, 0}, {0x1927, 0x1928, 0}, {0x1932, 0x1932, 0}, {0x1939, 0x193B, 0}, {0x1A17, 0x1A18, 0},
+	{0x1A1B, 0x1A1B, 0}, {0x1A56, 0x1A56, 0}, {0x1A58, 0x1A60, 0}, {0x1A62, 0x1A62, 0}, {0x1A65, 0x1A6C, 0},
+	{0x1A73, 0x1A7F, 0}, {0x1AB0, 0x1B03, 0}, {0x1B34, 0x1B34, 0}, {0x1B36, 0x1B3A, 0}, {0x1B3C, 0x1B3C, 0},
+	{0x1B42, 0x1B42, 0}, {0x1B6B, 0x1B73, 0}, {0x1B80, 0x1B81, 0}, {0x1BA2, 0x1BA5, 0}, {0x1BA8, 0x1BA9, 0},
+	{0x1BAB, 0x1BAD, 0}, {0x1BE6, 0x1BE6, 0}, {0x1BE8, 0x1BE9, 0}, {0x1BED, 0x1BED, 0}, {0x1BEF, 0x1BF1, 0},
+	{0x1C2C, 0x1C33, 0}, {0x1C36, 0x1C37, 0}, {0x1CD0, 0x1CD2, 0}, {0x1CD4, 0x1CE0, 0}, {0x1CE2, 0x1CE8, 0},
+	{0x1CED, 0x1CED, 0}, {0x1CF4, 0x1CF4, 0}, {0x1CF8, 0x1CF9, 0}, {0x1DC0, 0x1DFF, 0}, {0x200B, 0x200F, 0},
+	{0x202A, 0x202E, 0}, {0x2060, 0x206F, 0}, {0x20D0, 0x20F0, 0}, {0x231A, 0x231B, 2}, {0x2329, 0x232A, 2},
+	{0x23E9, 0x23EC, 2}, {0x23F0, 0x23F0, 2}, {0x23F3, 0x23F3, 2}, {0x25FD, 0x25FE, 2}, {0x2614, 0x2615, 2},
+	{0x2648, 0x2653, 2}, {0x267F, 0x267F, 2}, {0x2693, 0x2693, 2}, {0x26A1, 0x26A1, 2}, {0x26AA, 0x26AB, 2},
+	{0x26BD, 0x26BE, 2}, {0x26C4, 0x26C5, 2}, {0x26CE, 0x26CE, 2}, {0x26D4, 0x26D4, 2}, {0x26EA, 0x26EA, 2},
+	{0x26F2, 0x26F3, 2}, {0x26F5, 0x26F5, 2}, {0x26FA, 0x26FA, 2}, {0x26FD, 0x26FD, 2}, {0x2705, 0x2705, 2},
+	{0x270A, 0x270B, 2}, {0x2728, 0x2728, 2}, {0x274C, 0x274C, 2}, {0x274E, 0x274E, 2}, {0x2753, 0x2755, 2},
+	{0x2757, 0x2757, 2}, {0x2795, 0x2797, 2}, {0x27B0, 0x27B0, 2}, {0x27BF, 0x27BF, 2}, {0x2B1B, 0x2B1C, 2},
+	{0x2B50, 0x2B50, 2}, {0x2B55, 0x2B55, 2}, {0x2CEF, 0x2CF1, 0}, {0x2D7F, 0x2D7F, 0}, {0x2DE0, 0x2DFF, 0},
+	{0x2E80, 0x3029, 2}, {0x302A, 0x302D, 0}, {0x302E, 0x303E, 2}, {0x3041, 0x3096, 2}, {0x3099, 0x309A, 0},
+	{0x309B, 0x3247, 2}, {0x3250, 0x4DBF, 2}, {0x4E00, 0xA4C6, 2}, {0xA66F, 0xA672, 0}, {0xA674, 0xA67D, 0},
+	{0xA69E, 0xA69F, 0}, {0xA6F0, 0xA6F1, 0}, {0xA802, 0xA802, 0}, {0xA806, 0xA806, 0}, {0xA80B, 0xA80B, 0},
+	{0xA825, 0xA826, 0}, {0xA82C, 0xA82C, 0}, {0xA8C4, 0xA8C5, 0}, {0xA8E0, 0xA8F1, 0}, {0xA8FF, 0xA8FF, 0},
+	{0xA926, 0xA92D, 0}, {0xA947, 0xA951, 0}, {0xA960, 0xA97C, 2}, {0xA980, 0xA982, 0}, {0xA9B3, 0xA9B3, 0},
+	{0xA9B6, 0xA9B9, 0}, {0xA9BC, 0xA9BD, 0}, {0xA9E5, 0xA9E5, 0}, {0xAA29, 0xAA2E, 0}, {0xAA31, 0xAA32, 0},
+	{0xAA35, 0xAA36, 0}, {0xAA43, 0xAA43, 0}, {0xAA4C, 0xAA4C, 0}, {0xAA7C, 0xAA7C, 0}, {0xAAB0, 0xAAB0, 0},
+	{0xAAB2, 0xAAB4, 0}, {0xAAB7, 0xAAB8, 0}, {0xAABE, 0xAABF, 0}, {0xAAC1, 0xAAC1, 0}, {0xAAEC, 0xAAED, 0},
+	{0xAAF6, 0xAAF6, 0}, {0xABE5, 0xABE5, 0}, {0xABE8, 0xABE8, 0}, {0xABED, 0xABED, 0}, {0xAC00, 0xD7A3, 2},
+	{0xF900, 0xFAD9, 2}, {0xFB1E, 0xFB1E, 0}, {0xFE00, 0xFE0F, 0}, {0xFE10, 0xFE19, 2}, {0xFE20, 0xFE2F, 0},
+	{0xFE30, 0xFE6B, 2}, {0xFEFF, 0xFEFF, 0}, {0xFF01, 0xFF60, 2}, {0xFFE0, 0xFFE6, 2}, {0xFFF9, 0xFFFB, 0},
+	{0x101FD, 0x101FD, 0}, {0x102E0, 0x102E0, 0}, {0x10376, 0x1037A, 0}, {0x10A01, 0x10A0F, 0}, {0x10A38, 0x10A3F, 0},
+	{0x10AE5, 0x10AE6, 0}, {0x10D24, 0x10D27, 0}, {0x10EAB, 0x10EAC, 0}, {0x10F46, 0x10F50, 0}, {0x10F82, 0x10F85, 0},
+	{0x11001, 0x11001, 0}, {0x11038, 0x11046, 0}, {0x11070, 0x11070, 0}, {0x11073, 0x11074, 0}, {0x1107F, 0x11081, 0},
+	{0x110B3, 0x110B6, 0}, {0x110B9, 0x110BA, 0}, {0x110BD, 0x110BD, 0}, {0x110C2, 0x110CD, 0}, {0x11100, 0x11102, 0},
+	{0x11127, 0x1112B, 0}, {0x1112D, 0x11134, 0}, {0x11173, 0x11173, 0}, {0x11180, 0x11181, 0}, {0x111B6, 0x111BE, 0},
+	{0x111C9, 0x111CC, 0}, {0x111CF, 0x111CF, 0}, {0x1122F, 0x11231, 0}, {0x11234, 0x11234, 0}, {0x11236, 0x11237, 0},
+	{0x1123E, 0x1123E, 0}, {0x112DF, 0x112DF, 0}, {0x112E3, 0x112EA, 0}, {0x11300, 0x11301, 0}, {0x1133B, 0x1133C, 0},
+	{0x11340, 0x11340, 0}, {0x11366, 0x11374, 0}, {0x11438, 0x1143F, 0}, {0x11442, 0x11444, 0}, {0x11446, 0x11446, 0},
+	{0x1145E, 0x1145E, 0}, {0x114B3, 0x114B8, 0}, {0x114BA, 0x114BA, 0}, {0x114BF, 0x114C0, 0}, {0x114C2, 0x114C3, 0},
+	{0x115B2, 0x115B5, 0}, {0x115BC, 0x115BD, 0}, {0x115BF, 0x115C0, 0}, {0x115DC, 0x115DD, 0}, {0x11633, 0x1163A, 0},
+	{0x1163D, 0x1163D, 0}, {0x1163F, 0x11640, 0}, {0x116AB, 0x116AB, 0}, {0x116AD, 0x116AD, 0}, {0x116B0, 0x116B5, 0},
+	{0x116B7, 0x116B7, 0}, {0x1171D, 0x1171F, 0}, {0x11722, 0x11725, 0}, {0x11727, 0x1172B, 0}, {0x1182F, 0x11837, 0},
+	{0x11839, 0x1183A, 0}, {0x1193B, 0x1193C, 0}, {0x1193E, 0x1193E, 0}, {0x11943, 0x11943, 0}, {0x119D4, 0x119DB, 0},
+	{0x119E0, 0x119E0, 0}, {0x11A01, 0x11A0A, 0}, {0x11A33, 0x11A38, 0}, {0x11A3B, 0x11A3E, 0}, {0x11A47, 0x11A47, 0},
+	{0x11A51, 0x11A56, 0}, {0x11A59, 0x11A5B, 0}, {0x11A8A, 0x11A96, 0}, {0x11A98, 0x11A99, 0}, {0x11C30, 0x11C3D, 0},
+	{0x11C3F, 0x11C3F, 0}, {0x11C92, 0x11CA7, 0}, {0x11CAA, 0x11CB0, 0}, {0x11CB2, 0x11CB3, 0}, {0x11CB5, 0x11CB6, 0},
+	{0x11D31, 0x11D45, 0}, {0x11D47, 0x11D47, 0}, {0x11D90, 0x11D91, 0}, {0x11D95, 0x11D95, 0}, {0x11D97, 0x11D97, 0},
+	{0x11EF3, 0x11EF4, 0}, {0x13430, 0x13438, 0}, {0x16AF0, 0x16AF4, 0}, {0x16B30, 0x16B36, 0}, {0x16F4F, 0x16F4F, 0},
+	{0x16F8F, 0x16F92, 0}, {0x16FE0, 0x16FE3, 2}, {0x16FE4, 0x16FE4, 0}, {0x16FF0, 0x1B2FB, 2}, {0x1BC9D, 0x1BC9E, 0},
+	{0x1BCA0, 0x1CF46, 0}, {0x1D167, 0x1D169, 0}, {0x1D173, 0x1D182, 0}, {0x1D185, 0x1D18B, 0}, {0x1D1AA, 0x1D1AD, 0},
+	{0x1D242, 0x1D244, 0}, {0x1DA00, 0x1DA36, 0}, {0x1DA3B, 0x1DA6C, 0}, {0x1DA75, 0x1DA75, 0}, {0x1DA84, 0x1DA84, 0},
+	{0x1DA9B, 0x1DAAF, 0}, {0x1E000, 0x1E02A, 0}, {0x1E130, 0x1E136, 0}, {0x1E2AE, 0x1E2AE, 0}, {0x1E2EC, 0x1E2EF, 0},
+	{0x1E8D0, 0x1E8D6, 0}, {0x1E944, 0x1E94A, 0}, {0x1F004, 0x1F004, 2}, {0x1F0CF, 0x1F0CF, 2}, {0x1F18E, 0x1F18E, 2},
+	{0x1F191, 0x1F19A, 2}, {0x1F200, 0x1F320, 2}, {0x1F32D, 0x1F335, 2}, {0x1F337, 0x1F37C, 2}, {0x1F37E, 0x1F393, 2},
+	{0x1F3A0, 0x1F3CA, 2}, {0x1F3CF, 0x1F3D3, 2}, {0x1F3E0, 0x1F3F0, 2}, {0x1F3F4, 0x1F3F4, 2}, {0x1F3F8, 0x1F43E, 2},
+	{0x1F440, 0x1F440, 2}, {0x1F442, 0x1F4FC, 2}, {0x1F4FF, 0x1F53D, 2}, {0x1F54B, 0x1F54E, 2}, {0x1F550, 0x1F567, 2},
+	{0x1F57A, 0x1F57A, 2}, {0x1F595, 0x1F596, 2}, {0x1F5A4, 0x1F5A4, 2}, {0x1F5FB, 0x1F64F, 2}, {0x1F680, 0x1F6C5, 2},
+	{0x1F6CC, 0x1F6CC, 2}, {0x1F6D0, 0x1F6D2, 2}, {0x1F6D5, 0x1F6DF, 2}, {0x1F6EB, 0x1F6EC, 2}, {0x1F6F4, 0x1F6FC, 2},
+	{0x1F7E0, 0x1F7F0, 2}, {0x1F90C, 0x1F93A, 2}, {0x1F93C, 0x1F945, 2}, {0x1F947, 0x1F9FF, 2}, {0x1FA70, 0x1FAF6, 2},
+	{0x20000, 0x3FFFD, 2}, {0xE0001, 0xE01EF, 0},
+};
+
+//the Basic Multilingual Plane gets a table with 2 bits per code point, built from the
+//ranges at compile time, so the characters nearly all text uses cost one lookup
+//(it is filled a 64-bit word at a time rather than a code point at a time, which keeps
+//the build well inside compilers' limits on constexpr evaluation)
+struct WIDTH_TABLE {
+	uint64_t words[0x10000 / 32];
+};
+
+static constexpr uint64_t WIDTH_ONE_WORD = 0x5555555555555555; //32 code points of width 1
+
+static constexpr WIDTH_TABLE buildWidthTable() {
+	WIDTH_TABLE table = {};
+	for (uint64_t& word : table.words)
+		word = WIDTH_ONE_WORD;
+	for (const WIDTH_RANGE& range : widthRanges) {
+		char32_t last = std::min<char32_t>(range.last, 0xFFFF);
+		//one word at a time, setting the part of it the range covers
+		for (char32_t c = range.first; c <= last; c += 32 - c % 32) {
+			int count = (int) std::min<char32_t>(last - c + 1, 32 - c % 32);
+			uint64_t mask = ~(uint64_t) 0 >> (64 - count * 2) << (c % 32) * 2;
+			table.words[c / 32] = (table.words[c / 32] & ~mask) | (WIDTH_ONE_WORD * range.width & mask);
+		}
+	}
+	return table;
+}
+
+static constexpr WIDTH_TABLE widthTable = buildWidthTable();
+
+int ConsoleController::glyphWidth(char32_t codepoint) {
+	if (codepoint < 0x300) //ASCII and Latin-1, with the control characters taking no space
+		return codepoint >= ' ' && (codepoint < 0x7F || codepoint >= 0xA0) ? 1 : 0;
+	if (codepoint < 0x10000)
+		return (int) (widthTable.words[codepoint / 32] >> (codepoint % 32) * 2 & 3);
+
+	//the other planes are rare enough for a binary search
+	const WIDTH_RANGE* end = widthRanges + sizeof widthRanges / sizeof widthRanges[0];
+	const WIDTH_RANGE* range = std::upper_bound(widthRanges, end, codepoint,
+		[](char32_t c, const WIDTH_RANGE& r) { return c < r.first; });
+	if (range != widthRanges && codepoint <= range[-1].last)
+		return range[-1].width;
+	return codepoint <= 0x10FFFF ? 1 : 0;
+}
+
+//writes a code point as UTF-8, returning how many bytes it took
+static int encodeUtf8(char32_t codepoint, char* out) {
+	if (codepoint < 0x80) {
+		out[0] = (char) codepoint;
+		return 1;
+	}
+	if (codepoint < 0x800) {
+		out[0] = (char) (0xC0 | codepoint >> 6);
+		out[1] = (char) (0x80 | (codepoint & 0x3F));
+		return 2;
+	}
+	if (codepoint < 0x10000) {
+		out[0] = (char) (0xE0 | codepoint >> 12);
+		out[1] = (char) (0x80 | (codepoint >> 6 & 0x3F));
+		out[2] = (char) (0x80 | (codepoint & 0x3F));
+		return 3;
+	}
+	out[0] = (char) (0xF0 | codepoint >> 18);
+	out[1] = (char) (0x80 | (codepoint >> 12 & 0x3F));
+	out[2] = (char) (0x80 | (codepoint >> 6 & 0x3F));
+	out[3] = (char) (0x80 | (codepoint & 0x3F));
+	return 4;
+}
+
+/////////////////////////////////////////////////
+
+//the size the buffers are, after following any resize of the console
+ConsoleController::COORD_2D ConsoleController::getWindowSize() {
+	followWindowSize();
+	return bufferSize;
+}
+
+ConsoleController::COORD_2D ConsoleController::consoleSize() {
+#ifdef _WIN32
+	CONSOLE_SCREEN_BUFFER_INFO csbi;
+	COORD_2D size;
+
+	GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &csbi);
+	size.x = csbi.srWindow.Right - csbi.srWindow.Left + 1;
+	size.y = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+
+	return size;
+#elif defined(CONSOLECONTROLLER_HEADLESS)
+	return headlessSize;
+#else
+	//asked of the terminal every time, since curses only hears of a resize through getch(),
+	//which posix_readInput() has taken over
+	winsize ws;
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 && ws.ws_row > 0)
+		return {ws.ws_col, ws.ws_row};
+#ifdef CONSOLECONTROLLER_ANSI
+	return {80, 24}; //not a terminal, assume the traditional size
+#else
+	return {COLS, LINES};
+#endif
+#endif
+}
+
+ConsoleController::COORD_2D ConsoleController::getCurPos() {
+	//the back buffer's cursor is where the next output goes, even before present()
+	return cursorPos;
+}
+
+/////////////////////////////////////////////////
+
+void ConsoleController::cls() {
+	//blank the back buffer in the current color, the way the console's own clear does
+	fillCells(backBuffer, 0, (size_t) bufferStride * bufferSize.y, ' ', activeColor);
+	markAllDirty();
+	pendingClear = activeColor;
+	pendingScrollCount = 0; //nothing scrolled before this is left to show
+	cursorPos = {0, 0};
+}
+
+void ConsoleController::moveCursor(int x, int y) {
+	//clamp to the screen so buffer writes never go out of bounds
+	cursorPos.x = std::max(0, std::min(x, bufferSize.x - 1));
+	cursorPos.y = std::max(0, std::min(y, bufferSize.y - 1));
+}
+
+void ConsoleController::moveCursor(COORD_2D pos) {
+    moveCursor(pos.x, pos.y);
+}
+
+void ConsoleController::color(COLOR_ID colorId) {
+	activeColor = colorId;
+}
+
+// Drawing
+//(through a view of the whole screen, which does the clipping)
+void ConsoleController::fill(RECT_2D rect, char32_t glyph, COLOR_ID colorId) {
+	view({0, 0, bufferSize.x, bufferSize.y}).fill(rect, glyph, colorId);
+}
+
+void ConsoleController::drawHLine(int x, int y, int length, char32_t glyph, COLOR_ID colorId) {
+	view({0, 0, bufferSize.x, bufferSize.y}).drawHLine(x, y, length, glyph, colorId);
+}
+
+void ConsoleController::drawVLine(int x, int y, int length, char32_t glyph, COLOR_ID colorId) {
+	view({0, 0, bufferSize.x, bufferSize.y}).drawVLine(x, y, length, glyph, colorId);
+}
+
+void ConsoleController::drawBox(RECT_2D rect, BoxStyle style, COLOR_ID colorId) {
+	view({0, 0, bufferSize.x, bufferSize.y}).drawBox(rect, style, colorId);
+}
+
+// Row comparison
+//finds the first and last byte that differ between a and b, returning false if none do
+typedef bool (*DIFF_FUNCTION)(const unsigned char* a, const unsigned char* b, size_t length, size_t& first, size_t& last);
+
+#ifndef CONSOLECONTROLLER_X86_64
+static bool diffScalar(const unsigned char* a, const unsigned char* b, size_t length, size_t& first, size_t& last) {
+	size_t i = 0;
+	while (i < length && a[i] == b[i])
+		++i;
+	if (i == length)
+		return false;
+	size_t j = length - 1;
+	while (a[j] == b[j])
+		--j;
+	first = i;
+	last = j;
+	return true;
+}
+#endif
+
+#ifdef CONSOLECONTROLLER_X86_64
+#ifdef _MSC_VER
+#define TARGET_AVX2 //MSVC lets any function use any instruction set
+static int lowestBit(unsigned int mask) { unsigned long i; _BitScanForward(&i, mask); return (int) i; }
+static int highestBit(unsigned int mask) { unsigned long i; _BitScanReverse(&i, mask); return (int) i; }
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+static int lowestBit(unsigned int mask) { return __builtin_ctz(mask); }
+static int highestBit(unsigned int mask) { return 31 - __builtin_clz(mask); }
+#endif
+
+//the vector versions compare a block at a time from each end, and only look at
+//single bytes for whatever is left over at the ends
+static bool diffSse2(const unsigned char* a, const unsigned char* b, size_t length, size_t& first, size_t& last) {
+	size_t i = 0;
+	for (; i + 16 <= length; i += 16) {
+		__m128i equal = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (a + i)), _mm_loadu_si128((const __m128i*) (b + i)));
+		unsigned int differ = ~_mm_movemask_epi8(equal) & 0xFFFF;
+		if (differ) {
+			i += lowestBit(differ);
+			break;
+		}
+	}
+	while (i < length && a[i] == b[i])
+		++i;
+	if (i == length)
+		return false;
+	first = i;
+
+	size_t j = length;
+	for (; j >= i + 16; j -= 16) {
+		__m128i equal = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (a + j - 16)), _mm_loadu_si128((const __m128i*) (b + j - 16)));
+		unsigned int differ = ~_mm_movemask_epi8(equal) & 0xFFFF;
+		if (differ) {
+			j -= 15 - highestBit(differ);
+			break;
+		}
+	}
+	while (a[j - 1] == b[j - 1])
+		--j;
+	last = j - 1;
+	return true;
+}
+
+TARGET_AVX2 static bool diffAvx2(const unsigned char* a, const unsigned char* b, size_t length, size_t& first, size_t& last) {
+	size_t i = 0;
+	for (; i + 32 <= length; i += 32) {
+		__m256i equal = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (a + i)), _mm256_loadu_si256((const __m256i*) (b + i)));
+		unsigned int differ = ~(unsigned int) _mm256_movemask_epi8(equal);
+		if (differ) {
+			i += lowestBit(differ);
+			break;
+		}
+	}
+	while (i < length && a[i] == b[i])
+		++i;
+	if (i == length)
+		return false;
+	first = i;
+
+	size_t j = length;
+	for (; j >= i + 32; j -= 32) {
+		__m256i equal = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (a + j - 32)), _mm256_loadu_si256((const __m256i*) (b + j - 32)));
+		unsigned int differ = ~(unsigned int) _mm256_movemask_epi8(equal);
+		if (differ) {
+			j -= 31 - highestBit(differ);
+			break;
+		}
+	}
+	while (a[j - 1] == b[j - 1])
+		--j;
+	last = j - 1;
+	return true;
+}
+
+static bool cpuHasAvx2() {
+#ifdef _MSC_VER
+	//the CPU has to support it and the OS has to save the wider registers
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	__cpuid(info, 1);
+	if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28)) || (_xgetbv(0) & 6) != 6)
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+static bool findDifference(const void* a, const void* b, size_t length, size_t& first, size_t& last) {
+#ifdef CONSOLECONTROLLER_X86_64
+	static const DIFF_FUNCTION diff = cpuHasAvx2() ? diffAvx2 : diffSse2;
+#else
+	static const DIFF_FUNCTION diff = diffScalar;
+#endif
+	return diff((const unsigned char*) a, (const unsigned char*) b, length, first, last);
+}
+
+//the longest stretch of unchanged cells present() rewrites to keep a run going,
+//roughly what a cursor move over them would cost instead
+#ifdef CONSOLECONTROLLER_CURSES
+static const int MAX_GAP_REWRITE = 8; //curses drops cells that didn't change, so this only saves calls
+#elif defined(_WIN32)
+static const int MAX_GAP_REWRITE = 8; //every cursor move is an API call and a flush
+#else
+static const int MAX_GAP_REWRITE = 4; //"\x1b[nC"
+#endif
+
+//sends every cell that differs between the back and front buffers to the terminal,
+//looking only at the parts of rows that were written since the last present()
+void ConsoleController::present() {
+	if (frameDepth > 0)
+		return; //endFrame() presents the whole frame
+	followWindowSize();
+
+#if defined(CONSOLECONTROLLER_ANSI) && !defined(CONSOLECONTROLLER_HEADLESS)
+	if (resumed) {
+		//the shell had the terminal while we were stopped, so nothing on it can be trusted
+		resumed = 0;
+		termCursor = {-1, -1};
+		termColor = -1;
+		invalidate();
+	}
+#endif
+
+	//after a cls() the console can usually be cleared for less than blanking
+	//every cell it shows one by one
+	if (pendingClear >= 0 && clearIsCheaper()) {
+#ifdef CONSOLECONTROLLER_ANSI
+		openSync();
+#endif
+		clearTerminal((COLOR_ID) pendingClear);
+	}
+	pendingClear = -1;
+
+	//scrolled rows are moved on the console as well as in the front buffer,
+	//so the diff below finds them unchanged
+	for (int i = 0; i < pendingScrollCount; ++i) {
+#ifdef CONSOLECONTROLLER_ANSI
+		openSync();
+#endif
+		emitScroll(pendingScrolls[i]);
+		shiftRows(frontBuffer, pendingScrolls[i]);
+	}
+	pendingScrollCount = 0;
+
+	for (int y = 0; y < bufferSize.y; ++y) {
+		SPAN& span = dirtySpans[y];
+		if (span.start >= span.end)
+			continue;
+
+		//narrow the span down to the cells that really differ in any plane,
+		//skipping the row if none do
+		size_t row = (size_t) y * bufferStride;
+		size_t offset = row + span.start, count = span.end - span.start;
+		size_t low = count, high = 0, first, last;
+		if (findDifference(backBuffer.glyphs + offset, frontBuffer.glyphs + offset, count * sizeof(char32_t), first, last)) {
+			low = first / sizeof(char32_t);
+			high = last / sizeof(char32_t);
+		}
+		if (findDifference(backBuffer.colors + offset, frontBuffer.colors + offset, count, first, last)) {
+			low = std::min(low, first);
+			high = std::max(high, last);
+		}
+		if (findDifference(backBuffer.attributes + offset, frontBuffer.attributes + offset, count, first, last)) {
+			low = std::min(low, first);
+			high = std::max(high, last);
+		}
+		int x = span.start + (int) low, end = span.start + (int) high + 1;
+		span.start = bufferSize.x;
+		span.end = 0;
+
+		while (x < end) {
+			if (!cellChanged(row + x)) {
+				++x;
+				continue;
+			}
+
+			//gather the run of changed cells that share a color, always taking
+			//both halves of a wide character
+			int start = x;
+			if (backBuffer.attributes[row + start] & CELL_CONTINUATION)
+				--start;
+			COLOR_ID runColor = backBuffer.colors[row + x];
+			for (;;) {
+				while (x < end && cellChanged(row + x) && backBuffer.colors[row + x] == runColor)
+					++x;
+
+				//a few unchanged cells in the same color cost less to write again than to
+				//move the cursor over, so the run carries on through them if it continues after
+				int gap = x;
+				while (gap < end && gap - x < MAX_GAP_REWRITE && !cellChanged(row + gap) && backBuffer.colors[row + gap] == runColor)
+					++gap;
+				if (gap == x || gap >= end || !cellChanged(row + gap) || backBuffer.colors[row + gap] != runColor)
+					break;
+				x = gap;
+			}
+			if (backBuffer.attributes[row + x - 1] & CELL_WIDE)
+				++x;
+			copyCells(frontBuffer, backBuffer, row + start, x - start);
+			emitRun(start, y, x - start);
+		}
+	}
+
+	//leave the visible cursor where the next output would go
+	emitMove(std::min(cursorPos.x, bufferSize.x - 1), cursorPos.y);
+
+	//views only grow the cluster pool, so one they filled is swept here, between frames
+	{
+		std::lock_guard<std::mutex> lock(clusterPool->mutex);
+		if (!clusterPool->nextFreeSlot())
+			sweepClusters();
+	}
+	clusterPool->startFrame();
+#ifdef CONSOLECONTROLLER_CURSES
+	//curses writes the whole update in refresh(), so that is what gets wrapped
+	bool sync = syncUpdates && is_wintouched(stdscr);
+	if (sync) {
+		fputs("\x1b[?2026h", stdout);
+		fflush(stdout);
+	}
+	flush();
+	if (sync) {
+		fputs("\x1b[?2026l", stdout);
+		fflush(stdout);
+	}
+#else
+#ifdef CONSOLECONTROLLER_ANSI
+	if (syncOpen) {
+		appendOutput("\x1b[?2026l");
+		syncOpen = false;
+	}
+#endif
+	flush();
+#endif
+}
+
+void ConsoleController::beginFrame() {
+	++frameDepth;
+}
+
+void ConsoleController::endFrame() {
+	if (frameDepth > 0 && --frameDepth == 0)
+		present();
+}
+
+#ifdef CONSOLECONTROLLER_ANSI
+//starts a synchronized update ahead of the first thing present() draws, so a frame with
+//nothing to send doesn't send the markers either
+void ConsoleController::openSync() {
+	if (syncUpdates && !syncOpen) {
+		appendOutput("\x1b[?2026h");
+		syncOpen = true;
+	}
+}
+#endif
+
+#if defined(CONSOLECONTROLLER_ANSI) && !defined(CONSOLECONTROLLER_HEADLESS)
+// Signals
+static const int CAUGHT_SIGNALS[] = {SIGINT, SIGTERM, SIGTSTP, SIGCONT};
+
+//swaps one handler for another, leaving the signal alone if the program has its own,
+//the way curses only catches the signals nobody else did
+static void posix_swapHandler(int signal, void (*from)(int), void (*to)(int)) {
+	struct sigaction action;
+	sigaction(signal, NULL, &action);
+	if (action.sa_handler != from)
+		return;
+	action.sa_handler = to;
+	action.sa_flags = 0;
+	sigemptyset(&action.sa_mask);
+	sigaction(signal, &action, NULL);
+}
+
+void ConsoleController::catchSignals(bool catching) {
+	for (int signal : CAUGHT_SIGNALS) {
+		if (catching)
+			posix_swapHandler(signal, SIG_DFL, onSignal);
+		else
+			posix_swapHandler(signal, onSignal, SIG_DFL);
+	}
+}
+
+//gives the terminal back before the signal does what it would have done without us, and
+//takes it over again when the program is continued after being suspended
+void ConsoleController::onSignal(int signal) {
+	int savedErrno = errno;
+	if (signal == SIGCONT) {
+		tcsetattr(STDIN_FILENO, TCSAFLUSH, &rawTermios);
+		writeOutput(TERMINAL_SETUP, sizeof TERMINAL_SETUP - 1);
+		posix_swapHandler(SIGTSTP, SIG_DFL, onSignal);
+		resumed = 1; //present() redraws everything
+	} else {
+		restoreTerminal();
+		posix_swapHandler(signal, onSignal, SIG_DFL);
+		raise(signal); //delivered as soon as this handler returns
+	}
+	errno = savedErrno;
+}
+
+//only calls that are safe in a signal handler, and no output buffer
+void ConsoleController::restoreTerminal() {
+	writeOutput(TERMINAL_RESET, sizeof TERMINAL_RESET - 1);
+	tcsetattr(STDIN_FILENO, TCSAFLUSH, &savedTermios);
+}
+
+void ConsoleController::restoreAtExit() {
+	if (classInstances > 0)
+		restoreTerminal();
+}
+#endif
+
+void ConsoleController::invalidate(RECT_2D rect) {
+	int x0 = std::max(rect.x, 0), x1 = std::min(rect.x + rect.width, bufferSize.x);
+	int y0 = std::max(rect.y, 0), y1 = std::min(rect.y + rect.height, bufferSize.y);
+	if (x0 >= x1)
+		return;
+
+	for (int y = y0; y < y1; ++y) {
+		markDirty(y, x0, x1);
+
+		//the front buffer hasn't had the pending scrolls applied yet, so the row to mark
+		//there is the one that will have moved here once present() applies them
+		int from = y;
+		for (int i = pendingScrollCount - 1; i >= 0 && from >= 0; --i) {
+			const SCROLL& scroll = pendingScrolls[i];
+			if (from < scroll.top || from > scroll.bottom)
+				continue;
+			from += scroll.n;
+			if (from < scroll.top || from > scroll.bottom)
+				from = -1; //it comes free in the scroll, which blanks it on the console anyway
+		}
+		if (from >= 0)
+			std::fill_n(frontBuffer.glyphs + (size_t) from * bufferStride + x0, x1 - x0, UNKNOWN_GLYPH);
+	}
+}
+
+void ConsoleController::invalidate() {
+	RECT_2D screen = {0, 0, bufferSize.x, bufferSize.y};
+	invalidate(screen);
+}
+
+//hands everything queued so far to the terminal in a single write
+void ConsoleController::flush() {
+#ifdef CONSOLECONTROLLER_CURSES
+	refresh(); //curses does its own buffering
+#else
+	writeOutput(outBuffer, outLength);
+	outLength = 0;
+#endif
+}
+
+//sets how many bytes may queue up before they are written without waiting for flush()
+//(curses keeps its own buffer, so this has no effect there)
+void ConsoleController::setOutputBufferSize(size_t bytes) {
+#ifndef CONSOLECONTROLLER_CURSES
+	flush();
+	outCapacity = std::max(bytes, (size_t) 64);
+	if (classInstances > 0)
+		outBuffer = (char*) realloc(outBuffer, outCapacity);
+#else
+	(void) bytes;
+#endif
+}
+
+//scrolls a region of the console itself, blanking the rows that come free in the scroll's color
+void ConsoleController::emitScroll(const SCROLL& scroll) {
+#ifdef _WIN32
+	flush(); //queued text belongs where it was written
+	SMALL_RECT region = {0, (SHORT) scroll.top, (SHORT) (bufferSize.x - 1), (SHORT) scroll.bottom};
+	COORD destination = {0, (SHORT) (scroll.top - scroll.n)};
+	CHAR_INFO fill = {};
+	fill.Char.UnicodeChar = L' '; //the W variant reads the whole union
+	fill.Attributes = colorAttributes[scroll.color];
+	ScrollConsoleScreenBufferW(hStdout, &region, &region, destination, &fill);
+#elif defined(CONSOLECONTROLLER_ANSI)
+	//new lines are filled with the current background, so the color goes first; setting
+	//the margins homes the cursor, and they are reset so line feeds scroll the whole screen again
+	applyColor(scroll.color);
+	char seq[48];
+	int n = snprintf(seq, sizeof seq, "\x1b[%d;%dr\x1b[%d%c\x1b[r", scroll.top + 1, scroll.bottom + 1,
+		std::abs(scroll.n), scroll.n > 0 ? 'S' : 'T');
+	appendOutput(seq, n);
+	termCursor = {0, 0};
+#else
+	//curses spots the moved lines itself and scrolls the terminal on refresh()
+	bkgdset(colorAttributes[scroll.color] | ' ');
+	scrollok(stdscr, true);
+	setscrreg(scroll.top, scroll.bottom);
+	scrl(scroll.n);
+	setscrreg(0, bufferSize.y - 1);
+	scrollok(stdscr, false);
+	bkgdset(' ');
+	termColor = -1;
+#endif
+}
+
+//sends n cells of the back buffer, all the same color, starting at (x, y)
+void ConsoleController::emitRun(int x, int y, int n) {
+	size_t index = (size_t) y * bufferStride + x;
+#ifdef CONSOLECONTROLLER_ANSI
+	openSync();
+#endif
+	emitMove(x, y);
+	applyColor(backBuffer.colors[index]);
+
+	//one color change, then the text goes out as a whole, a stack buffer at a time
+	//(the second cell of a wide character has nothing of its own to send)
+	char text[256];
+	int length = 0;
+	bool ascii = true;
+	for (int i = 0; i < n; ++i) {
+		char32_t glyph = backBuffer.glyphs[index + i];
+		if (backBuffer.attributes[index + i] & CELL_CONTINUATION)
+			continue;
+		if (glyph < 0x80) {
+			text[length++] = (char) glyph;
+		} else {
+			char32_t codepoints[MAX_CLUSTER_LENGTH];
+			int count = clusterCodepoints(glyph, codepoints);
+#ifdef CONSOLECONTROLLER_CURSES
+			//curses places each code point by its own width, so any that would push past
+			//the cell are left out rather than let them shift everything after it
+			int room = (backBuffer.attributes[index + i] & CELL_WIDE ? 2 : 1) - glyphWidth(codepoints[0]);
+			int kept = 1;
+			for (int j = 1; j < count; ++j) {
+				int width = glyphWidth(codepoints[j]);
+				if (width <= room) {
+					room -= width;
+					codepoints[kept++] = codepoints[j];
+				}
+			}
+			count = kept;
+#endif
+			while (count > 1 && codepoints[count - 1] == 0x200D)
+				--count; //a joiner with nothing after it would join whatever is sent next
+			for (int j = 0; j < count; ++j) {
+				if (length > (int) sizeof text - 4) {
+					emitText(text, length);
+					length = 0;
+				}
+				length += encodeUtf8(codepoints[j], text + length);
+			}
+			ascii = false;
+		}
+		if (length > (int) sizeof text - 4) {
+			emitText(text, length);
+			length = 0;
+		}
+	}
+	emitText(text, length);
+
+	//the console wraps (or sticks at the margin) after the last column, so stop guessing there;
+	//not every terminal agrees on how wide other characters are, so stop after those too
+	termCursor.x += n;
+	if (termCursor.x >= bufferSize.x || !ascii)
+		termCursor = {-1, -1};
+}
+
+void ConsoleController::emitText(const char* text, int length) {
+#ifdef CONSOLECONTROLLER_CURSES
+	addnstr(text, length);
+#else
+	appendOutput(text, length);
+#endif
+}
+
+//moves the console's cursor, skipping the move entirely when it is already there and
+//otherwise picking the cheapest way to get there
+void ConsoleController::emitMove(int x, int y) {
+	if (termCursor.x == x && termCursor.y == y)
+		return;
+
+#ifdef CONSOLECONTROLLER_CURSES
+	move(y, x); //curses already optimizes the actual motion
+#else
+	int gap = (termCursor.y == y && x > termCursor.x) ? x - termCursor.x : 0;
+#ifdef _WIN32
+	//any API call means flushing queued text, so a few characters are always cheaper
+	const int maxRewrite = 8;
+#else
+	char seq[32];
+	int n;
+	if (gap > 0)
+		n = gap == 1 ? snprintf(seq, sizeof seq, "\x1b[C") : snprintf(seq, sizeof seq, "\x1b[%dC", gap);
+	else if (x == 0 && termCursor.y == y)
+		n = snprintf(seq, sizeof seq, "\r");
+	else if (x == 0 && termCursor.y >= 0 && termCursor.y + 1 == y)
+		n = snprintf(seq, sizeof seq, "\r\n");
+	else if (x == 0)
+		n = snprintf(seq, sizeof seq, "\x1b[%dH", y + 1);
+	else
+		n = snprintf(seq, sizeof seq, "\x1b[%d;%dH", y + 1, x + 1);
+	const int maxRewrite = n;
+#endif
+
+	//hopping right over cells the console already shows in the active color is cheapest
+	//done by simply writing them again
+	if (gap > 0 && gap <= maxRewrite) {
+		size_t index = (size_t) y * bufferStride + termCursor.x;
+		char text[32];
+		int i = 0;
+		while (i < gap && frontBuffer.colors[index + i] == termColor &&
+				frontBuffer.glyphs[index + i] < 0x80 && frontBuffer.attributes[index + i] == 0) {
+			text[i] = (char) frontBuffer.glyphs[index + i];
+			++i;
+		}
+		if (i == gap) {
+			appendOutput(text, gap);
+			termCursor.x = x;
+			return;
+		}
+	}
+
+#ifdef _WIN32
+	flush();
+	COORD position = {(SHORT) x, (SHORT) y};
+	SetConsoleCursorPosition(hStdout, position);
+#else
+	appendOutput(seq, n);
+#endif
+#endif // CONSOLECONTROLLER_CURSES
+
+	termCursor.x = x;
+	termCursor.y = y;
+}
+
+//whether clearing the whole console and then drawing what was written since the last cls()
+//takes fewer cells than sending every cell that differs from what the console shows now
+bool ConsoleController::clearIsCheaper() {
+	COLOR_ID blank = (COLOR_ID) pendingClear;
+	size_t changed = 0, drawn = 0;
+	for (int y = 0; y < bufferSize.y; ++y) {
+		size_t row = (size_t) y * bufferStride;
+		for (int x = 0; x < bufferSize.x; ++x) {
+			changed += cellChanged(row + x);
+			drawn += backBuffer.glyphs[row + x] != ' ' || backBuffer.colors[row + x] != blank || backBuffer.attributes[row + x] != 0;
+		}
+	}
+	return drawn < changed;
+}
+
+//blanks the whole console in the given color, and the front buffer with it
+void ConsoleController::clearTerminal(COLOR_ID colorId) {
+#ifdef _WIN32
+	flush();
+	CONSOLE_SCREEN_BUFFER_INFO csbi;
+	GetConsoleScreenBufferInfo(hStdout, &csbi);
+	DWORD cells = csbi.dwSize.X * csbi.dwSize.Y, n;
+	COORD origin = {0, 0};
+	FillConsoleOutputCharacterA(hStdout, ' ', cells, origin, &n);
+	FillConsoleOutputAttribute(hStdout, colorAttributes[colorId], cells, origin, &n);
+	SetConsoleCursorPosition(hStdout, origin); //also scrolls the window back to the top
+	termCursor = {0, 0};
+#elif defined(CONSOLECONTROLLER_ANSI)
+	//erasing fills with the current background, so the color goes first
+	applyColor(colorId);
+	appendOutput("\x1b[2J");
+#else
+	//erase() rather than clear(), which would make curses repaint the whole screen
+	bkgdset(colorAttributes[colorId] | ' ');
+	erase();
+	bkgdset(' '); //the background would otherwise be mixed into everything written later
+	termColor = -1; //and changing it changed the attributes set for writing too
+	termCursor = {0, 0}; //erase() also homes the cursor
+#endif
+
+	fillCells(frontBuffer, 0, (size_t) bufferStride * bufferSize.y, ' ', colorId);
+}
+
+#ifndef CONSOLECONTROLLER_CURSES
+void ConsoleController::appendOutput(const char* data, size_t length) {
+	//a full buffer goes out as one write, and anything larger than the buffer skips it entirely
+	if (outLength + length > outCapacity) {
+		flush();
+		if (length > outCapacity) {
+			writeOutput(data, length);
+			return;
+		}
+	}
+	memcpy(outBuffer + outLength, data, length);
+	outLength += length;
+}
+
+void ConsoleController::appendOutput(const char* str) {
+	appendOutput(str, strlen(str));
+}
+
+void ConsoleController::writeOutput(const char* data, size_t length) {
+	size_t done = 0;
+	while (done < length) {
+#ifdef _WIN32
+		//WriteConsoleA() only works on a console; redirected output is written as plain bytes
+		DWORD n;
+		BOOL written = consoleOutput
+			? WriteConsoleA(hStdout, data + done, (DWORD) (length - done), &n, NULL)
+			: WriteFile(hStdout, data + done, (DWORD) (length - done), &n, NULL);
+		if (!written)
+			break;
+#elif defined(CONSOLECONTROLLER_HEADLESS)
+		//there is no terminal; the screen model already holds everything that was drawn
+		(void) data;
+		size_t n = length;
+#else
+		ssize_t n = write(STDOUT_FILENO, data + done, length - done);
+		if (n < 0)
+			break; //nothing sensible to do if the terminal went away
+#endif
+		done += n;
+	}
+}
+#endif
+
+void ConsoleController::applyColor(COLOR_ID colorId) {
+	if (colorId == termColor)
+		return; //already active on the console
+	termColor = colorId;
+
+#ifdef _WIN32
+	flush(); //queued text still has to come out in the old color
+	SetConsoleTextAttribute(hStdout, colorAttributes[colorId]);
+#elif defined(CONSOLECONTROLLER_ANSI)
+	appendOutput(sgrCodes[colorId].bytes, sgrCodes[colorId].length);
+#else
+	attrset(colorAttributes[colorId]);
+#endif
+}
+
+/////////////////////////////////////////////////
+
+void ConsoleController::output(std::string_view s) {
+	putChars(s.data(), s.length());
+}
+
+void ConsoleController::output(const std::string& s) {
+	putChars(s.data(), s.length());
+}
+
+void ConsoleController::output(const char* s) {
+	putChars(s, strlen(s));
+}
+
+void ConsoleController::output(const char* s, size_t length) {
+	putChars(s, length);
+}
+
+void ConsoleController::output(char c) {
+	if (utf8State.remaining == 0 && (unsigned char) c < 0x80)
+		putChar(c);
+	else
+		putChars(&c, 1); //part of a UTF-8 sequence
+}
+
+//printable ASCII, which is one byte and one cell per character
+static inline bool isPlainAscii(char c) {
+	return c >= ' ' && c < 0x7F;
+}
+
+//copies the printable ASCII that s starts with into glyphs, one cell per byte, and returns how
+//many bytes that was; every such byte is valid UTF-8 and one column wide, so a run needs no decoding
+//(with glyphs NULL, the run is only measured)
+typedef size_t (*WIDEN_FUNCTION)(const unsigned char* s, size_t length, char32_t* glyphs);
+
+static size_t widenScalar(const unsigned char* s, size_t length, char32_t* glyphs) {
+	size_t i = 0;
+	while (i < length && s[i] >= ' ' && s[i] < 0x7F) {
+		if (glyphs)
+			glyphs[i] = s[i];
+		++i;
+	}
+	return i;
+}
+
+#ifdef CONSOLECONTROLLER_X86_64
+//the vector versions check and widen a block at a time, leaving the block the run ends in,
+//which needs non-ASCII bytes decoding or stops short, to the scalar loop
+static size_t widenSse2(const unsigned char* s, size_t length, char32_t* glyphs) {
+	const __m128i zero = _mm_setzero_si128(), low = _mm_set1_epi8(' ' - 1), high = _mm_set1_epi8(0x7F);
+	size_t i = 0;
+	for (; i + 16 <= length; i += 16) {
+		//bytes from 0x80 up are negative, so one signed range check rules them out too
+		__m128i bytes = _mm_loadu_si128((const __m128i*) (s + i));
+		__m128i plain = _mm_and_si128(_mm_cmpgt_epi8(bytes, low), _mm_cmplt_epi8(bytes, high));
+		if (_mm_movemask_epi8(plain) != 0xFFFF)
+			break;
+		if (!glyphs)
+			continue;
+		__m128i lo = _mm_unpacklo_epi8(bytes, zero), hi = _mm_unpackhi_epi8(bytes, zero);
+		_mm_storeu_si128((__m128i*) (glyphs + i), _mm_unpacklo_epi16(lo, zero));
+		_mm_storeu_si128((__m128i*) (glyphs + i + 4), _mm_unpackhi_epi16(lo, zero));
+		_mm_storeu_si128((__m128i*) (glyphs + i + 8), _mm_unpacklo_epi16(hi, zero));
+		_mm_storeu_si128((__m128i*) (glyphs + i + 12), _mm_unpackhi_epi16(hi, zero));
+	}
+	return i + widenScalar(s + i, length - i, glyphs ? glyphs + i : NULL);
+}
+
+TARGET_AVX2 static size_t widenAvx2(const unsigned char* s, size_t length, char32_t* glyphs) {
+	const __m256i low = _mm256_set1_epi8(' ' - 1), high = _mm256_set1_epi8(0x7F);
+	size_t i = 0;
+	for (; i + 32 <= length; i += 32) {
+		__m256i bytes = _mm256_loadu_si256((const __m256i*) (s + i));
+		__m256i plain = _mm256_and_si256(_mm256_cmpgt_epi8(bytes, low), _mm256_cmpgt_epi8(high, bytes));
+		if (_mm256_movemask_epi8(plain) != -1)
+			break;
+		if (!glyphs)
+			continue;
+		for (int j = 0; j < 32; j += 8)
+			_mm256_storeu_si256((__m256i*) (glyphs + i + j), _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) (s + i + j))));
+	}
+	return i + widenScalar(s + i, length - i, glyphs ? glyphs + i : NULL);
+}
+#endif
+
+static size_t widenAscii(const char* s, size_t length, char32_t* glyphs) {
+#ifdef CONSOLECONTROLLER_X86_64
+	static const WIDEN_FUNCTION widen = cpuHasAvx2() ? widenAvx2 : widenSse2;
+#else
+	static const WIDEN_FUNCTION widen = widenScalar;
+#endif
+	return widen((const unsigned char*) s, length, glyphs);
+}
+
+//feeds one byte of a multi-byte UTF-8 sequence to state, returning true once it completes a
+//code point; a byte that cuts a sequence short gives U+FFFD without being used up (consumed
+//is false), since it starts whatever comes next
+bool ConsoleController::decodeUtf8(UTF8_STATE& state, unsigned char c, char32_t& codepoint, bool& consumed) {
+	consumed = true;
+	if (state.remaining > 0) {
+		if ((c & 0xC0) != 0x80) {
+			state.remaining = 0;
+			consumed = false;
+			codepoint = REPLACEMENT_GLYPH;
+			return true;
+		}
+		state.codepoint = state.codepoint << 6 | (c & 0x3F);
+		if (--state.remaining > 0)
+			return false;
+		codepoint = state.codepoint;
+		bool valid = codepoint >= state.minimum && codepoint <= 0x10FFFF &&
+			(codepoint < 0xD800 || codepoint > 0xDFFF); //not overlong, past Unicode or a surrogate
+		if (!valid)
+			codepoint = REPLACEMENT_GLYPH;
+		return true;
+	}
+
+	if (c >= 0xC2 && c <= 0xDF) {
+		state = {(char32_t) (c & 0x1F), 0x80, 1};
+	} else if (c >= 0xE0 && c <= 0xEF) {
+		state = {(char32_t) (c & 0x0F), 0x800, 2};
+	} else if (c >= 0xF0 && c <= 0xF4) {
+		state = {(char32_t) (c & 0x07), 0x10000, 3};
+	} else {
+		codepoint = REPLACEMENT_GLYPH; //a stray continuation byte or one UTF-8 never uses
+		return true;
+	}
+	return false;
+}
+
+//decodes UTF-8 into the back buffer at the cursor; a sequence split across calls is picked up
+//where it was left, and anything that isn't valid UTF-8 comes out as U+FFFD
+void ConsoleController::putChars(const char* s, size_t length) {
+	size_t i = 0;
+	while (i < length) {
+		unsigned char c = s[i];
+		if (utf8State.remaining > 0 || c >= 0x80) {
+			char32_t codepoint;
+			bool consumed;
+			if (decodeUtf8(utf8State, c, codepoint, consumed))
+				putGlyph(codepoint);
+			if (consumed)
+				++i;
+			continue;
+		}
+		if (!isPlainAscii(s[i]) || cursorPos.x >= bufferSize.x) {
+			putChar(s[i++]); //control characters and wrapping take the slow path
+			continue;
+		}
+
+		//copy the ASCII run that fits on this line in one go; splitting wide characters
+		//only looks at the cells either side of it, so that can wait until its end is known
+		size_t index = (size_t) cursorPos.y * bufferStride + cursorPos.x;
+		size_t room = std::min(length - i, (size_t) (bufferSize.x - cursorPos.x));
+		size_t run = widenAscii(s + i, room, backBuffer.glyphs + index);
+		int end = cursorPos.x + (int) run;
+		i += run;
+		SPAN written = splitWide(cursorPos.y, cursorPos.x, end, 0, bufferSize.x);
+		memset(backBuffer.colors + index, activeColor, end - cursorPos.x);
+		memset(backBuffer.attributes + index, 0, end - cursorPos.x);
+		markDirty(cursorPos.y, written.start, written.end);
+		cursorPos.x = end;
+	}
+}
+
+//overwriting either half of a wide character leaves the other half with nothing to show,
+//so it becomes a blank; called before cells start to end of row y are written, returning
+//them along with any blanked neighbor, for the caller to mark dirty (nothing outside left
+//to right is looked at, for views, whose edges no wide character crosses)
+ConsoleController::SPAN ConsoleController::splitWide(int y, int start, int end, int left, int right) {
+	SPAN written = {start, end};
+	size_t row = (size_t) y * bufferStride;
+	if (start > left && (backBuffer.attributes[row + start] & CELL_CONTINUATION)) {
+		fillCells(backBuffer, row + start - 1, 1, ' ', backBuffer.colors[row + start - 1]);
+		written.start = start - 1;
+	}
+	if (end < right && (backBuffer.attributes[row + end] & CELL_CONTINUATION)) {
+		fillCells(backBuffer, row + end, 1, ' ', backBuffer.colors[row + end]);
+		written.end = end + 1;
+	}
+	return written;
+}
+
+//writes one character into the back buffer at the cursor, in as many cells as it is wide
+void ConsoleController::putGlyph(char32_t codepoint) {
+	int width = codepoint >= ' ' && codepoint < 0x7F ? 1 : glyphWidth(codepoint);
+	if (codepoint >= 0x300 && joinCluster(codepoint, width))
+		return;
+	if (width == 0)
+		return; //nothing to attach it to
+	placeGlyph(codepoint, width);
+}
+
+static inline bool isRegionalIndicator(char32_t codepoint) {
+	return codepoint >= 0x1F1E6 && codepoint <= 0x1F1FF;
+}
+
+static inline bool isEmojiModifier(char32_t codepoint) {
+	return codepoint >= 0x1F3FB && codepoint <= 0x1F3FF;
+}
+
+//what the character in a cell becomes with a code point added, when it belongs with it like
+//a combining mark, a skin tone, whatever follows a zero width joiner or the second half of a
+//flag, or 0 if it starts a character of its own; flag is set when the cell is the first half
+//of a flag, which takes two cells once it is whole
+char32_t ConsoleController::extendCluster(size_t index, char32_t codepoint, int width, bool maySweep, bool& flag) {
+	char32_t glyph = backBuffer.glyphs[index];
+	bool wide = (backBuffer.attributes[index] & CELL_WIDE) != 0;
+	char32_t codepoints[MAX_CLUSTER_LENGTH];
+	int length = clusterCodepoints(glyph, codepoints);
+	flag = length == 1 && isRegionalIndicator(codepoints[0]) && isRegionalIndicator(codepoint);
+	if (width != 0 && codepoints[length - 1] != 0x200D && !flag && !(wide && isEmojiModifier(codepoint)))
+		return 0;
+
+	char32_t handle = 0;
+	if (length < MAX_CLUSTER_LENGTH) { //otherwise it is too long to keep any more of
+		codepoints[length++] = codepoint;
+		handle = internCluster(codepoints, length, maySweep);
+	}
+	if (handle == 0) {
+		flag = false;
+		return glyph; //it goes without
+	}
+	return handle;
+}
+
+//adds a code point to the character left of the cursor if it belongs with it, returning
+//false if it starts a character of its own
+bool ConsoleController::joinCluster(char32_t codepoint, int width) {
+	if (cursorPos.x == 0)
+		return false;
+	size_t row = (size_t) cursorPos.y * bufferStride;
+	int x = cursorPos.x - 1;
+	if (backBuffer.attributes[row + x] & CELL_CONTINUATION)
+		--x;
+	size_t index = row + x;
+	bool flag;
+	char32_t glyph = extendCluster(index, codepoint, width, true, flag);
+	if (glyph == 0)
+		return false;
+
+	if (flag) {
+		//each half of a flag on its own is one cell wide, so it is written again
+		//from where the first half went
+		fillCells(backBuffer, index, 1, ' ', backBuffer.colors[index]);
+		markDirty(cursorPos.y, x, x + 1);
+		cursorPos.x = x;
+		placeGlyph(glyph, 2);
+		return true;
+	}
+	backBuffer.glyphs[index] = glyph;
+	markDirty(cursorPos.y, x, x + (backBuffer.attributes[index] & CELL_WIDE ? 2 : 1));
+	return true;
+}
+
+//writes a glyph at the cursor that is known to take width cells
+void ConsoleController::placeGlyph(char32_t glyph, int width) {
+	if (width > bufferSize.x) {
+		glyph = REPLACEMENT_GLYPH; //a console too narrow to hold it at all
+		width = 1;
+	}
+
+	//like a terminal, only wrap once there is something to put on the next line,
+	//so filling the bottom-right cell doesn't scroll the screen; a wide character
+	//that doesn't fit in the last column goes to the next line whole
+	if (cursorPos.x + width > bufferSize.x) {
+		cursorPos.x = 0;
+		if (++cursorPos.y >= bufferSize.y) {
+			scrollRegion(0, bufferSize.y - 1, 1);
+			cursorPos.y = bufferSize.y - 1;
+		}
+	}
+
+	size_t index = (size_t) cursorPos.y * bufferStride + cursorPos.x;
+	SPAN written = {cursorPos.x, cursorPos.x + width};
+	//(checked here first, since this is the path every single character takes)
+	if (backBuffer.attributes[index] != 0 || (cursorPos.x + width < bufferSize.x && backBuffer.attributes[index + width] != 0))
+		written = splitWide(cursorPos.y, cursorPos.x, cursorPos.x + width, 0, bufferSize.x);
+	backBuffer.glyphs[index] = glyph;
+	backBuffer.colors[index] = activeColor;
+	backBuffer.attributes[index] = 0;
+	if (width == 2) {
+		backBuffer.glyphs[index + 1] = 0;
+		backBuffer.colors[index + 1] = activeColor;
+		backBuffer.attributes[index] = CELL_WIDE;
+		backBuffer.attributes[index + 1] = CELL_CONTINUATION;
+	}
+	markDirty(cursorPos.y, written.start, written.end);
+	cursorPos.x += width;
+}
+
+//writes one ASCII character into the back buffer at the cursor, handling control
+//characters the same way the console would
+void ConsoleController::putChar(char c) {
+	switch (c) {
+		case '\n':
+			cursorPos.x = 0;
+			++cursorPos.y;
+			break;
+		case '\r':
+			cursorPos.x = 0;
+			break;
+		case '\b':
+			if (cursorPos.x > 0)
+				--cursorPos.x;
+			return;
+		case '\t':
+			do {
+				putChar(' ');
+			} while (cursorPos.x % 8 != 0);
+			return;
+		default:
+			if (isPlainAscii(c))
+				putGlyph((unsigned char) c);
+			return; //other control characters have no cell
+	}
+
+	if (cursorPos.y >= bufferSize.y) {
+		scrollRegion(0, bufferSize.y - 1, 1);
+		cursorPos.y = bufferSize.y - 1;
+	}
+}
+
+//moves rows top to bottom up by n (down when n is negative), blanking the rows that come free
+//in the current color; present() scrolls the console the same way rather than redrawing them
+void ConsoleController::scrollRegion(int top, int bottom, int n) {
+	top = std::max(top, 0);
+	bottom = std::min(bottom, bufferSize.y - 1);
+	int height = bottom - top + 1;
+	if (height <= 0 || n == 0)
+		return;
+
+	SCROLL scroll = {top, bottom, std::max(-height, std::min(n, height)), activeColor};
+	shiftRows(backBuffer, scroll);
+
+	//the dirty spans travel with their rows, since the front buffer's rows will move
+	//the same way; the rows that come free will match once they are blanked there too
+	SPAN clean = {bufferSize.x, 0};
+	int lines = std::abs(scroll.n);
+	if (scroll.n > 0) {
+		std::copy(dirtySpans + top + lines, dirtySpans + bottom + 1, dirtySpans + top);
+		std::fill(dirtySpans + bottom + 1 - lines, dirtySpans + bottom + 1, clean);
+	} else {
+		std::copy_backward(dirtySpans + top, dirtySpans + bottom + 1 - lines, dirtySpans + bottom + 1);
+		std::fill(dirtySpans + top, dirtySpans + top + lines, clean);
+	}
+
+	//keep the scroll for present() to pass on, merged with the last one when they match;
+	//a scroll of the whole region, or one that doesn't fit, simply gets the region redrawn
+	SCROLL* last = pendingScrollCount > 0 ? &pendingScrolls[pendingScrollCount - 1] : NULL;
+	if (last && last->top == top && last->bottom == bottom && last->color == scroll.color &&
+			(last->n > 0) == (scroll.n > 0) && std::abs(last->n + scroll.n) < height) {
+		last->n += scroll.n;
+	} else if (lines < height && pendingScrollCount < MAX_PENDING_SCROLLS) {
+		pendingScrolls[pendingScrollCount++] = scroll;
+	} else {
+		for (int y = top; y <= bottom; ++y)
+			markDirty(y, 0, bufferSize.x);
+	}
+}
+
+//moves the rows of a scroll within one buffer and blanks the ones that come free
+void ConsoleController::shiftRows(PLANES& planes, const SCROLL& scroll) {
+	int lines = std::abs(scroll.n);
+	int height = scroll.bottom - scroll.top + 1;
+	size_t top = (size_t) scroll.top * bufferStride;
+	size_t moved = (size_t) (height - lines) * bufferStride;
+	size_t from = scroll.n > 0 ? top + (size_t) lines * bufferStride : top;
+	size_t to = scroll.n > 0 ? top : top + (size_t) lines * bufferStride;
+	size_t blank = scroll.n > 0 ? top + moved : top;
+
+	memmove(planes.glyphs + to, planes.glyphs + from, moved * sizeof(char32_t));
+	memmove(planes.colors + to, planes.colors + from, moved);
+	memmove(planes.attributes + to, planes.attributes + from, moved);
+	fillCells(planes, blank, (size_t) lines * bufferStride, ' ', scroll.color);
+}
+
+void ConsoleController::fillCells(PLANES& planes, size_t index, size_t count, char32_t glyph, COLOR_ID color) {
+	std::fill_n(planes.glyphs + index, count, glyph);
+	memset(planes.colors + index, color, count);
+	memset(planes.attributes + index, 0, count);
+}
+
+void ConsoleController::copyCells(PLANES& to, const PLANES& from, size_t index, size_t count) {
+	memcpy(to.glyphs + index, from.glyphs + index, count * sizeof(char32_t));
+	memcpy(to.colors + index, from.colors + index, count);
+	memcpy(to.attributes + index, from.attributes + index, count);
+}
+
+bool ConsoleController::cellChanged(size_t index) {
+	return backBuffer.glyphs[index] != frontBuffer.glyphs[index] ||
+		backBuffer.colors[index] != frontBuffer.colors[index] ||
+		backBuffer.attributes[index] != frontBuffer.attributes[index];
+}
+
+//rows are padded to a multiple of this many cells, so every row of every plane starts
+//on a cache line of its own and a whole-row scan touches no line of its neighbors (the
+//vector loops still load unaligned, since dirty spans start at any column)
+static const int ROW_ALIGNMENT = 64;
+
+//both buffers start out blank, matching a freshly cleared terminal
+void ConsoleController::allocateBuffers() {
+	bufferStride = (bufferSize.x + ROW_ALIGNMENT - 1) / ROW_ALIGNMENT * ROW_ALIGNMENT;
+	size_t cells = (size_t) bufferStride * bufferSize.y;
+	PLANES* buffers[2] = {&backBuffer, &frontBuffer};
+	for (PLANES* planes : buffers) {
+		//all three planes share one block: glyphs, then colors, then attributes
+		unsigned char* block = (unsigned char*) ::operator new[](cells * (sizeof(char32_t) + 2), std::align_val_t(ROW_ALIGNMENT));
+		planes->glyphs = (char32_t*) block;
+		planes->colors = block + cells * sizeof(char32_t);
+		planes->attributes = planes->colors + cells;
+		fillCells(*planes, 0, cells, ' ', 0);
+	}
+
+	SPAN clean = {bufferSize.x, 0};
+	dirtySpans = new SPAN[bufferSize.y];
+	std::fill(dirtySpans, dirtySpans + bufferSize.y, clean);
+	pendingScrollCount = 0;
+	cursorPos = {0, 0};
+	clusterPool = new CLUSTER_POOL;
+}
+
+//resizes the buffers when the console has changed size since the last frame, keeping
+//whatever of the back buffer still fits and sending all of it again, since the console
+//will have cut or rewrapped what it showed
+void ConsoleController::followWindowSize() {
+	COORD_2D size = consoleSize();
+	if (size.x == bufferSize.x && size.y == bufferSize.y)
+		return;
+#ifdef CONSOLECONTROLLER_CURSES
+	resizeterm(size.y, size.x);
+	clearok(curscr, true); //curses can't know what the terminal shows now either
+#endif
+
+	//the back buffer and cluster pool are kept out of freeBuffers(), so cells can be copied over
+	PLANES old = backBuffer;
+	int oldStride = bufferStride;
+	COORD_2D oldSize = bufferSize;
+	CLUSTER_POOL* pool = clusterPool;
+	backBuffer.glyphs = NULL;
+	clusterPool = NULL;
+	freeBuffers();
+	bufferSize = size;
+	allocateBuffers();
+	delete clusterPool;
+	clusterPool = pool;
+
+	int width = std::min(oldSize.x, size.x);
+	for (int y = 0; y < std::min(oldSize.y, size.y); ++y) {
+		size_t from = (size_t) y * oldStride, to = (size_t) y * bufferStride;
+		std::copy(old.glyphs + from, old.glyphs + from + width, backBuffer.glyphs + to);
+		std::copy(old.colors + from, old.colors + from + width, backBuffer.colors + to);
+		std::copy(old.attributes + from, old.attributes + from + width, backBuffer.attributes + to);
+		if (backBuffer.attributes[to + width - 1] & CELL_WIDE)
+			fillCells(backBuffer, to + width - 1, 1, ' ', backBuffer.colors[to + width - 1]); //cut in half
+	}
+	::operator delete[](old.glyphs, std::align_val_t(ROW_ALIGNMENT));
+
+	cursorPos.x = std::min(cursorPos.x, size.x - 1);
+	cursorPos.y = std::min(cursorPos.y, size.y - 1);
+	termCursor = {-1, -1};
+	termColor = -1;
+	invalidate();
+}
+
+void ConsoleController::freeBuffers() {
+	PLANES none = {NULL, NULL, NULL};
+	::operator delete[](backBuffer.glyphs, std::align_val_t(ROW_ALIGNMENT));
+	::operator delete[](frontBuffer.glyphs, std::align_val_t(ROW_ALIGNMENT));
+	backBuffer = frontBuffer = none;
+	delete[] dirtySpans;
+	dirtySpans = NULL;
+	delete clusterPool;
+	clusterPool = NULL;
+}
+
+void ConsoleController::markDirty(int y, int start, int end) {
+	SPAN& span = dirtySpans[y];
+	span.start = std::min(span.start, start);
+	span.end = std::max(span.end, end);
+}
+
+void ConsoleController::markAllDirty() {
+	SPAN all = {0, bufferSize.x};
+	std::fill(dirtySpans, dirtySpans + bufferSize.y, all);
+}
+
+// Grapheme clusters
+//the handle of a cluster, added to the pool if it isn't there yet, or 0 if the pool is full;
+//views can't sweep, since other threads may be writing the cells a sweep reads, so the pool
+//only grows for them
+char32_t ConsoleController::internCluster(const char32_t* codepoints, int length, bool maySweep) {
+	CLUSTER_POOL& pool = *clusterPool;
+	std::lock_guard<std::mutex> lock(pool.mutex);
+	size_t i = pool.find(codepoints, length);
+	if (pool.table[i] == 0) {
+		if (!pool.nextFreeSlot()) {
+			//sweeping only pays off if it frees a good share of the pool, otherwise it grows
+			size_t live = maySweep ? sweepClusters() : pool.clusters.size();
+			if (live > pool.clusters.size() * 3 / 4 && pool.clusters.size() < CLUSTER_POOL::MAX_CLUSTERS) {
+				pool.clusters.resize(pool.clusters.size() * 2);
+				pool.rebuildTable();
+			}
+			if (!pool.nextFreeSlot())
+				return 0;
+			i = pool.find(codepoints, length);
+		}
+		CLUSTER_POOL::CLUSTER& cluster = pool.clusters[pool.nextFree];
+		std::copy(codepoints, codepoints + length, cluster.codepoints);
+		cluster.length = length;
+		pool.table[i] = (unsigned int) pool.nextFree + 1;
+	}
+	pool.clusters[pool.table[i] - 1].generation = pool.generation;
+	return CLUSTER_BIT | (pool.table[i] - 1);
+}
+
+//the code points a glyph stands for, returning how many there are
+int ConsoleController::clusterCodepoints(char32_t glyph, char32_t* codepoints) {
+	if (!(glyph & CLUSTER_BIT) || glyph == UNKNOWN_GLYPH) {
+		codepoints[0] = glyph;
+		return 1;
+	}
+	std::lock_guard<std::mutex> lock(clusterPool->mutex);
+	const CLUSTER_POOL::CLUSTER& cluster = clusterPool->clusters[glyph & ~CLUSTER_BIT];
+	std::copy(cluster.codepoints, cluster.codepoints + cluster.length, codepoints);
+	return cluster.length;
+}
+
+//frees the clusters that have dropped out of both buffers as the cells holding them were
+//overwritten, returning how many are left; rather than clearing marks first, each sweep is
+//a new generation, so anything not stamped since the frame started is garbage
+size_t ConsoleController::sweepClusters() {
+	CLUSTER_POOL& pool = *clusterPool;
+	unsigned int generation = ++pool.generation;
+	size_t cells = (size_t) bufferStride * bufferSize.y;
+	const PLANES* buffers[2] = {&backBuffer, &frontBuffer};
+	for (const PLANES* planes : buffers) {
+		for (size_t i = 0; i < cells; ++i) {
+			char32_t glyph = planes->glyphs[i];
+			if ((glyph & CLUSTER_BIT) && glyph != UNKNOWN_GLYPH)
+				pool.clusters[glyph & ~CLUSTER_BIT].generation = generation;
+		}
+	}
+
+	size_t live = 0;
+	for (CLUSTER_POOL::CLUSTER& cluster : pool.clusters) {
+		if (cluster.length != 0 && cluster.generation < pool.frameGeneration)
+			cluster.length = 0;
+		else if (cluster.length != 0)
+			++live;
+	}
+	pool.nextFree = 0;
+	pool.rebuildTable();
+	return live;
+}
+
+/////////////////////////////////////////////////
+
+// Views
+//views drawn from separate threads still share the dirty spans, so each call marks what it
+//wrote under this lock, once, instead of as it goes
+static std::mutex viewMutex;
+
+ConsoleController::View ConsoleController::view(RECT_2D area) {
+	return View(area, 0, 0, bufferSize.x, bufferSize.y);
+}
+
+ConsoleController::View::View(RECT_2D area, int left, int top, int right, int bottom) {
+	origin = {area.x, area.y};
+	size = {std::max(area.width, 0), std::max(area.height, 0)};
+	clipLeft = std::max(area.x, left);
+	clipTop = std::max(area.y, top);
+	clipRight = std::min(area.x + size.x, right);
+	clipBottom = std::min(area.y + size.y, bottom);
+	cursorPos = {0, 0};
+	activeColor = ConsoleController::activeColor;
+	utf8State = {0, 0, 0};
+	writtenTop = writtenBottom = 0;
 
-/////////////////////////////////////////////////
+	//a wide character across an edge is blanked now, while the view is made, so that
+	//drawing never has to look past the edges at cells another view may be writing
+	int rightEdge = std::min(clipRight, bufferSize.x), bottomEdge = std::min(clipBottom, bufferSize.y);
+	if (clipLeft >= rightEdge || (clipLeft == 0 && rightEdge == bufferSize.x))
+		return;
+	for (int y = clipTop; y < bottomEdge; ++y) {
+		size_t row = (size_t) y * bufferStride;
+		if (clipLeft > 0 && (backBuffer.attributes[row + clipLeft] & CELL_CONTINUATION)) {
+			fillCells(backBuffer, row + clipLeft - 1, 2, ' ', backBuffer.colors[row + clipLeft - 1]);
+			touch(y, {clipLeft - 1, clipLeft + 1});
+		}
+		if (rightEdge < bufferSize.x && (backBuffer.attributes[row + rightEdge] & CELL_CONTINUATION)) {
+			fillCells(backBuffer, row + rightEdge - 1, 2, ' ', backBuffer.colors[row + rightEdge - 1]);
+			touch(y, {rightEdge - 1, rightEdge + 1});
+		}
+	}
+	markWritten();
+}
 
-ConsoleController::ConsoleController() {
-	// Init data members
-	throttleInitialized = false;
+ConsoleController::View ConsoleController::View::view(RECT_2D area) const {
+	RECT_2D screenArea = {origin.x + area.x, origin.y + area.y, area.width, area.height};
+	View inner(screenArea, clipLeft, clipTop, clipRight, clipBottom);
+	inner.activeColor = activeColor;
+	return inner;
+}
 
-	// Only setup the console on the first allocation
-	// since this must be done only once until the last destruction
-	if (classInstances == 0) {
-#ifdef _WIN32
-		hStdout = GetStdHandle(STD_OUTPUT_HANDLE);
-#else
-		initscr();
-		cbreak();
-		noecho();
-		keypad(stdscr, true);
-		start_color();
-#endif
-		cls();
+ConsoleController::COORD_2D ConsoleController::View::getSize() const {
+	return size;
+}
 
-		//moved inside here since these are now static
-		for (int i = 0; i < 256; i++) {
-#ifdef _WIN32
-            colors[i] = {0, 0, false, false};
-#else
-            foreBoldFlags[i] = false;
-#endif
-        }
-    }
+ConsoleController::COORD_2D ConsoleController::View::getCurPos() const {
+	return cursorPos;
+}
 
-    ++classInstances;
+void ConsoleController::View::moveCursor(int x, int y) {
+	cursorPos = {x, y}; //anything written outside the view is clipped away, so there is nothing to clamp
 }
 
-ConsoleController::~ConsoleController(void) {
-	--classInstances;
-	if (classInstances == 0) {
-		cls();
+void ConsoleController::View::moveCursor(COORD_2D pos) {
+	moveCursor(pos.x, pos.y);
+}
 
-#ifndef _WIN32
-		endwin();
-#endif
-	}
+void ConsoleController::View::color(COLOR_ID colorId) {
+	activeColor = colorId;
 }
 
-void ConsoleController::initColor(COLOR_ID colorId, int fg, int bg, bool fBold, bool bBold) {
-#ifdef _WIN32
-	COLOR newColor = {fg, bg, fBold, bBold};
-    colors[colorId] = newColor;
-#else
-	if (bBold)
-        init_pair(colorId + 1, fg, bg + 8); // +8 is for adding the bold flag
-    else
-        init_pair(colorId + 1, fg, bg);
-    foreBoldFlags[colorId] = fBold;
-#endif
+void ConsoleController::View::fill(RECT_2D rect, char32_t glyph, COLOR_ID colorId) {
+	int x0 = std::max(origin.x + rect.x, clipLeft), x1 = std::min({origin.x + rect.x + rect.width, clipRight, bufferSize.x});
+	int y0 = std::max(origin.y + rect.y, clipTop), y1 = std::min({origin.y + rect.y + rect.height, clipBottom, bufferSize.y});
+	if (x0 >= x1)
+		return;
+	if (glyphWidth(glyph) != 1)
+		glyph = REPLACEMENT_GLYPH; //every cell gets its own copy, so it has to fit in one
+
+	for (int y = y0; y < y1; ++y) {
+		touch(y, splitWide(y, x0, x1, clipLeft, std::min(clipRight, bufferSize.x)));
+		fillCells(backBuffer, (size_t) y * bufferStride + x0, x1 - x0, glyph, colorId);
+	}
+	markWritten();
 }
 
-/////////////////////////////////////////////////
+void ConsoleController::View::drawHLine(int x, int y, int length, char32_t glyph, COLOR_ID colorId) {
+	RECT_2D line = {x, y, length, 1};
+	fill(line, glyph, colorId);
+}
 
-ConsoleController::COORD_2D ConsoleController::getWindowSize() {
-#ifdef _WIN32
-	CONSOLE_SCREEN_BUFFER_INFO csbi;
-	COORD_2D size;
+void ConsoleController::View::drawVLine(int x, int y, int length, char32_t glyph, COLOR_ID colorId) {
+	RECT_2D line = {x, y, 1, length};
+	fill(line, glyph, colorId);
+}
 
-	GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &csbi);
-	size.x = csbi.srWindow.Right - csbi.srWindow.Left + 1;
-	size.y = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+void ConsoleController::View::drawBox(RECT_2D rect, BoxStyle style, COLOR_ID colorId) {
+	//top left, top right, bottom left, bottom right, horizontal, vertical
+	static const char32_t lines[][6] = {
+		{'+', '+', '+', '+', '-', '|'},
+		{0x250C, 0x2510, 0x2514, 0x2518, 0x2500, 0x2502},
+		{0x2554, 0x2557, 0x255A, 0x255D, 0x2550, 0x2551},
+		{0x250F, 0x2513, 0x2517, 0x251B, 0x2501, 0x2503},
+		{0x256D, 0x256E, 0x2570, 0x256F, 0x2500, 0x2502}
+	};
+	if (rect.width <= 0 || rect.height <= 0)
+		return;
+	const char32_t* line = lines[style];
+	int right = rect.x + rect.width - 1, bottom = rect.y + rect.height - 1;
 
-	return size;
-#else
-	return {COLS, LINES};
-#endif
+	drawHLine(rect.x + 1, rect.y, rect.width - 2, line[4], colorId);
+	drawHLine(rect.x + 1, bottom, rect.width - 2, line[4], colorId);
+	drawVLine(rect.x, rect.y + 1, rect.height - 2, line[5], colorId);
+	drawVLine(right, rect.y + 1, rect.height - 2, line[5], colorId);
+	drawHLine(rect.x, rect.y, 1, line[0], colorId);
+	drawHLine(right, rect.y, 1, line[1], colorId);
+	drawHLine(rect.x, bottom, 1, line[2], colorId);
+	drawHLine(right, bottom, 1, line[3], colorId);
 }
 
-ConsoleController::COORD_2D ConsoleController::getCurPos() {
-#ifdef _WIN32
-	CONSOLE_SCREEN_BUFFER_INFO csbi;
-	COORD_2D pos;
+void ConsoleController::View::output(std::string_view s) {
+	putChars(s.data(), s.length());
+}
 
-	GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &csbi);
-	pos.x = csbi.dwCursorPosition.X;
-	pos.y = csbi.dwCursorPosition.Y;
+void ConsoleController::View::output(const std::string& s) {
+	putChars(s.data(), s.length());
+}
 
-	return pos;
-#else
-    return {getcurx(stdscr), getcury(stdscr)};
-	//TODO: implement under posix
-#endif
+void ConsoleController::View::output(const char* s) {
+	putChars(s, strlen(s));
 }
 
-/////////////////////////////////////////////////
+void ConsoleController::View::output(const char* s, size_t length) {
+	putChars(s, length);
+}
 
-void ConsoleController::cls() {
-#ifdef _WIN32
-	system("cls");
-#else
-	clear();
-#endif
+void ConsoleController::View::output(char c) {
+	putChars(&c, 1);
 }
 
-void ConsoleController::moveCursor(int x, int y) {
-#ifdef _WIN32
-	COORD position = {x, y};
-    SetConsoleCursorPosition(hStdout, position);
-#else
-	move(y, x);
-#endif
+//the same as the screen's own putChars(), except that nothing wraps or scrolls: each line
+//of text is clipped to the view a run at a time, and only the part inside is written
+void ConsoleController::View::putChars(const char* s, size_t length) {
+	int right = std::min(clipRight, bufferSize.x), bottom = std::min(clipBottom, bufferSize.y);
+	size_t i = 0;
+	while (i < length) {
+		unsigned char c = s[i];
+		if (utf8State.remaining > 0 || c >= 0x80) {
+			char32_t codepoint;
+			bool consumed;
+			if (decodeUtf8(utf8State, c, codepoint, consumed))
+				putGlyph(codepoint);
+			if (consumed)
+				++i;
+			continue;
+		}
+		if (!isPlainAscii(s[i])) {
+			++i;
+			if (c == '\n') {
+				cursorPos.x = 0;
+				++cursorPos.y;
+			} else if (c == '\r') {
+				cursorPos.x = 0;
+			} else if (c == '\b') {
+				if (cursorPos.x > 0)
+					--cursorPos.x;
+			} else if (c == '\t') {
+				do {
+					placeGlyph(' ', 1);
+				} while (cursorPos.x % 8 != 0);
+			}
+			continue; //other control characters have no cell
+		}
+
+		//whatever part of the run is left of the view is only measured, the part inside
+		//is copied in one go, and the rest only measured again
+		int x = origin.x + cursorPos.x, y = origin.y + cursorPos.y;
+		size_t run = 0;
+		if (y >= clipTop && y < bottom && x < right) {
+			if (x < clipLeft)
+				run = widenAscii(s + i, std::min(length - i, (size_t) (clipLeft - x)), NULL);
+			int start = x + (int) run;
+			if (start >= clipLeft) {
+				size_t index = (size_t) y * bufferStride + start;
+				size_t shown = widenAscii(s + i + run, std::min(length - i - run, (size_t) (right - start)), backBuffer.glyphs + index);
+				if (shown > 0) {
+					touch(y, splitWide(y, start, start + (int) shown, clipLeft, right));
+					memset(backBuffer.colors + index, activeColor, shown);
+					memset(backBuffer.attributes + index, 0, shown);
+					run += shown;
+				}
+			}
+		}
+		run += widenAscii(s + i + run, length - i - run, NULL);
+		i += run;
+		cursorPos.x += (int) run;
+	}
+	markWritten();
 }
 
-void ConsoleController::moveCursor(COORD_2D pos) {
-    moveCursor(pos.x, pos.y);
+void ConsoleController::View::putGlyph(char32_t codepoint) {
+	int width = glyphWidth(codepoint);
+	int x = origin.x + cursorPos.x, y = origin.y + cursorPos.y;
+	if (codepoint >= 0x300 && y >= clipTop && y < std::min(clipBottom, bufferSize.y) &&
+			x > clipLeft && x <= std::min(clipRight, bufferSize.x)) {
+		//it can only join the character to its left if that is inside the view too
+		size_t row = (size_t) y * bufferStride;
+		int left = x - 1;
+		if (backBuffer.attributes[row + left] & CELL_CONTINUATION)
+			--left;
+		bool flag;
+		char32_t glyph = left >= clipLeft ? extendCluster(row + left, codepoint, width, false, flag) : 0;
+		if (glyph != 0) {
+			if (flag) {
+				fillCells(backBuffer, row + left, 1, ' ', backBuffer.colors[row + left]);
+				touch(y, {left, left + 1});
+				cursorPos.x = left - origin.x;
+				placeGlyph(glyph, 2);
+			} else {
+				backBuffer.glyphs[row + left] = glyph;
+				touch(y, {left, left + (backBuffer.attributes[row + left] & CELL_WIDE ? 2 : 1)});
+			}
+			return;
+		}
+	}
+	if (width != 0)
+		placeGlyph(codepoint, width);
 }
 
-//TODO: make the windows side of this function not unnecessarily ugly
-void ConsoleController::color(COLOR_ID colorId) {
-#ifdef _WIN32
-	COLOR curColor = colors[colorId];
-    int colorFlags = 0;
-
-    //consider making a magic table for this
-
-    if (curColor.foreBold)
-        colorFlags |= FOREGROUND_INTENSITY;
-    if (curColor.backBold)
-        colorFlags |= BACKGROUND_INTENSITY;
-
-    if (curColor.foreground == COLOR_MAGENTA ||
-        curColor.foreground == COLOR_RED     ||
-        curColor.foreground == COLOR_YELLOW  ||
-        curColor.foreground == COLOR_WHITE     )
-        colorFlags |= FOREGROUND_RED;
-    if (curColor.foreground == COLOR_YELLOW  ||
-        curColor.foreground == COLOR_GREEN   ||
-        curColor.foreground == COLOR_CYAN    ||
-        curColor.foreground == COLOR_WHITE     )
-        colorFlags |= FOREGROUND_GREEN;
-    if (curColor.foreground == COLOR_CYAN    ||
-        curColor.foreground == COLOR_BLUE    ||
-        curColor.foreground == COLOR_MAGENTA ||
-        curColor.foreground == COLOR_WHITE     )
-        colorFlags |= FOREGROUND_BLUE;
-
-    if (curColor.background == COLOR_MAGENTA ||
-        curColor.background == COLOR_RED     ||
-        curColor.background == COLOR_YELLOW  ||
-        curColor.background == COLOR_WHITE     )
-        colorFlags |= BACKGROUND_RED;
-    if (curColor.background == COLOR_YELLOW  ||
-        curColor.background == COLOR_GREEN   ||
-        curColor.background == COLOR_CYAN    ||
-        curColor.background == COLOR_WHITE     )
-        colorFlags |= BACKGROUND_GREEN;
-    if (curColor.background == COLOR_CYAN    ||
-        curColor.background == COLOR_BLUE    ||
-        curColor.background == COLOR_MAGENTA ||
-        curColor.background == COLOR_WHITE     )
-        colorFlags |= BACKGROUND_BLUE;
-
-    SetConsoleTextAttribute(hStdout, colorFlags);
-#else
-	if (foreBoldFlags[colorId])
-        attrset(COLOR_PAIR(colorId + 1) | A_BOLD);
-    else
-        attrset(COLOR_PAIR(colorId + 1));
-#endif
+void ConsoleController::View::placeGlyph(char32_t glyph, int width) {
+	int x = origin.x + cursorPos.x, y = origin.y + cursorPos.y;
+	cursorPos.x += width;
+	int x0 = std::max(x, clipLeft), x1 = std::min({x + width, clipRight, bufferSize.x});
+	if (y < clipTop || y >= std::min(clipBottom, bufferSize.y) || x0 >= x1)
+		return;
+
+	size_t index = (size_t) y * bufferStride + x0;
+	touch(y, splitWide(y, x0, x1, clipLeft, std::min(clipRight, bufferSize.x)));
+	if (x1 - x0 < width) {
+		//a wide character cut in half by the edge, so the half inside is left blank
+		fillCells(backBuffer, index, x1 - x0, ' ', activeColor);
+		return;
+	}
+	backBuffer.glyphs[index] = glyph;
+	backBuffer.colors[index] = activeColor;
+	backBuffer.attributes[index] = 0;
+	if (width == 2) {
+		backBuffer.glyphs[index + 1] = 0;
+		backBuffer.colors[index + 1] = activeColor;
+		backBuffer.attributes[index] = CELL_WIDE;
+		backBuffer.attributes[index + 1] = CELL_CONTINUATION;
+	}
 }
 
-/////////////////////////////////////////////////
+void ConsoleController::View::touch(int y, SPAN span) {
+	if (writtenTop >= writtenBottom) {
+		writtenLeft = span.start;
+		writtenRight = span.end;
+		writtenTop = y;
+		writtenBottom = y + 1;
+		return;
+	}
+	writtenLeft = std::min(writtenLeft, span.start);
+	writtenRight = std::max(writtenRight, span.end);
+	writtenTop = std::min(writtenTop, y);
+	writtenBottom = std::max(writtenBottom, y + 1);
+}
 
-void ConsoleController::output(std::string s) {
-#ifdef _WIN32
-	std::cout << s;
-#else
-	printw("%s", s.c_str());
-#endif
+void ConsoleController::View::markWritten() {
+	if (writtenTop >= writtenBottom)
+		return;
+	std::lock_guard<std::mutex> lock(viewMutex);
+	for (int y = writtenTop; y < writtenBottom; ++y)
+		markDirty(y, writtenLeft, writtenRight);
+	writtenTop = writtenBottom = 0;
 }
 
 /////////////////////////////////////////////////
 
+//removes the last character from typed UTF-8, with any marks or joined code points that
+//went into the same cells, and returns how many columns it took on screen
+static int popCharacter(std::string& str) {
+	int width = 0;
+	while (!str.empty()) {
+		size_t start = str.size() - 1;
+		while (start > 0 && ((unsigned char) str[start] & 0xC0) == 0x80)
+			--start;
+		size_t length = str.size() - start;
+		char32_t codepoint = (unsigned char) str[start] & (length == 1 ? 0x7F : 0x7F >> length);
+		for (size_t i = 1; i < length; ++i)
+			codepoint = codepoint << 6 | (str[start + i] & 0x3F);
+		str.erase(start);
+
+		int codepointWidth = ConsoleController::glyphWidth(codepoint);
+		width = std::max(width, codepointWidth);
+		bool joined = str.size() >= 3 && str.compare(str.size() - 3, 3, "\xE2\x80\x8D") == 0; //after a ZWJ
+		if (codepointWidth != 0 && !joined)
+			break;
+	}
+	return width;
+}
+
 std::string ConsoleController::waitForInput() {
     return waitForInput("\n");
 }
 
-//TODO: look into making this SpecialKeyCode-proof
 std::string ConsoleController::waitForInput(char delineator) {
     return waitForInput(std::string(1, delineator));
 }
 
 std::string ConsoleController::waitForInput(std::string delineators) {
-    char input;
+    int input;
     std::string str;
 
     while (true) {
         //get cursor position preemptively to handle backspace
         COORD_2D pos = getCurPos();
         input = echoKey(); //get each individual keystroke
+        if (input == 0) //input has ended (e.g. a headless script ran out), so keep what there is
+            break;
 
         if (input == '\b') { //manually handle backspace
             if (!str.empty()) { //if there's anything to backspace
-                str.pop_back(); //remove the last character
+                int width = popCharacter(str); //remove the last character, all of its bytes
                 //handle cursor movement
-                if (pos.x == 0) { //if cursor is all the way to the left
+                if (pos.x < width) { //if the character ended the row above
                     //move it to the end of the row above
-                    moveCursor(getWindowSize().x - 1, pos.y - 1);
+                    moveCursor(getWindowSize().x - width, pos.y - 1);
                 } else {
-                    moveCursor(pos.x - 1, pos.y); //move it back one space
+                    moveCursor(pos.x - width, pos.y); //move it back as many columns as it took
                 }
             } else {
                 //the console auto-moves the cursor after a backspace
@@ -237,66 +2382,193 @@ std::string ConsoleController::waitForInput(std::string delineators) {
             pos = getCurPos();
             output(' ');
             moveCursor(pos.x, pos.y);
-        } else {
+        } else if (input < 0x100) { //special keys, pastes' markers and Alt+key aren't text
             //if it matches any of the delineating characters,
             //break the input cycle
             for (size_t i = 0; i < delineators.length(); ++i)
-                if (input == delineators.at(i))
+                if (input == (unsigned char) delineators.at(i))
                     goto soSueMe; //SO FUCKING SUE ME
             //otherwise, append the recent character
-            str += input;
+            str += (char) input;
         }
     }
     soSueMe:
 
     //continue taking and ignoring characters until a newline
-    if (input != '\n') {
-        while (echoKey() != '\n');
+    if (input != '\n' && input != 0) {
+        while ((input = echoKey()) != '\n' && input != 0);
     }
 
     return str;
 }
 
 int ConsoleController::getKey() {
+	present();
+	return readKey(0);
+}
+
+int ConsoleController::waitForKey() {
+	present();
+	return readKey(-1);
+}
+
+//starts reading keys on a background thread; getKey(), waitForKey() and the
+//event methods then take them from the queue instead of the console
+void ConsoleController::startInputThread() {
+#ifdef CONSOLECONTROLLER_HEADLESS
+	//scripted input is already waiting, there is nothing to read it from
+#else
+	if (inputQueue)
+		return;
+	inputQueue = new INPUT_QUEUE;
+#ifdef _WIN32
+	inputQueue->wakeEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (!inputQueue->wakeEvent) {
+#else
+	if (pipe(inputQueue->wakePipe) != 0) {
+#endif
+		delete inputQueue;
+		inputQueue = NULL;
+		return;
+	}
+	inputQueue->thread = std::thread(&INPUT_QUEUE::run, inputQueue);
+#endif
+}
+
+//stops the background reader; keys it read but nobody took yet are discarded
+void ConsoleController::stopInputThread() {
+	if (!inputQueue)
+		return;
+	inputQueue->running.store(false);
+#ifdef _WIN32
+	SetEvent(inputQueue->wakeEvent);
+#else
+	char wake = 0;
+	if (write(inputQueue->wakePipe[1], &wake, 1) < 0) {
+		//the reader will still notice on its next key
+	}
+#endif
+	inputQueue->thread.join();
 #ifdef _WIN32
-	if (_kbhit())
-        return waitForKey();
-    return 0;
+	CloseHandle(inputQueue->wakeEvent);
 #else
-    timeout(0); // Set non-blocking mode
-    return posix_translateKey();
+	close(inputQueue->wakePipe[0]);
+	close(inputQueue->wakePipe[1]);
+#endif
+	delete inputQueue;
+	inputQueue = NULL;
+}
+
+//takes the next key without waiting, returning false if there is none
+//(unlike getKey() this doesn't present(), so it is safe to call mid-frame)
+bool ConsoleController::pollEvent(KEY_EVENT& event) {
+	event.key = readKey(0);
+	return event.key != 0;
+}
+
+//waits up to timeoutMs (forever if negative) for the next key, returning false on timeout
+bool ConsoleController::waitEvent(KEY_EVENT& event, long timeoutMs) {
+	present();
+	event.key = readKey(timeoutMs);
+	return event.key != 0;
+}
+
+//reads one translated key, from the input thread's queue if it is running,
+//returning 0 if none arrived within timeoutMs (a negative timeout waits forever)
+int ConsoleController::readKey(long timeoutMs) {
+	int key = waitKey(timeoutMs);
+	followWindowSize(); //the console may well have been resized while we waited
+	return key;
+}
+
+int ConsoleController::waitKey(long timeoutMs) {
+	if (inputQueue) {
+		KEY_EVENT event;
+		return inputQueue->wait(event, timeoutMs) ? event.key : 0;
+	}
+
+#ifdef _WIN32
+	//_getch() waits by itself; only a timeout needs the console handle waited on first
+	if (timeoutMs >= 0 && !windows_waitForKey(timeoutMs, NULL))
+		return 0;
+	return windows_translateKey();
+#elif defined(CONSOLECONTROLLER_HEADLESS)
+	//scripted input is all there already, so waiting would never turn up more
+	(void) timeoutMs;
+	posix_expireEscape();
+	int key;
+	return posix_nextKey(key) ? key : 0;
+#else
+	return posix_translateKey(timeoutMs);
 #endif
 }
 
-int ConsoleController::waitForKey() {
 #ifdef _WIN32
-	char result = _getch();
+//scan codes that follow a 0 or 0xE0 prefix from _getch()
+// see: http://stackoverflow.com/q/10463201
+static const struct {
+	int scanCode;
+	int key;
+} windowsKeys[] = {
+	{0x48, ARROW_UP},   {0x50, ARROW_DOWN}, {0x4D, ARROW_RIGHT}, {0x4B, ARROW_LEFT},
+	{0x47, HOME_KEY},   {0x4F, END_KEY},    {0x49, PAGE_UP},     {0x51, PAGE_DOWN},
+	{0x52, INSERT_KEY}, {0x53, DELETE_KEY},
+	{0x3B, F1_KEY}, {0x3C, F2_KEY}, {0x3D, F3_KEY}, {0x3E, F4_KEY},  {0x3F, F5_KEY},  {0x40, F6_KEY},
+	{0x41, F7_KEY}, {0x42, F8_KEY}, {0x43, F9_KEY}, {0x44, F10_KEY}, {0x85, F11_KEY}, {0x86, F12_KEY},
+	{0x8D, ARROW_UP | CTRL_MOD}, {0x91, ARROW_DOWN | CTRL_MOD},
+	{0x74, ARROW_RIGHT | CTRL_MOD}, {0x73, ARROW_LEFT | CTRL_MOD},
+	{0x77, HOME_KEY | CTRL_MOD}, {0x75, END_KEY | CTRL_MOD},
+	{0x84, PAGE_UP | CTRL_MOD},  {0x76, PAGE_DOWN | CTRL_MOD}
+};
+
+//waits up to timeoutMs (forever if negative) for a key _getch() will return, giving up early
+//if wake is set; returns false if no key came, or if stdin isn't a console that can be waited on
+bool windows_waitForKey(long timeoutMs, HANDLE wake) {
+	HANDLE handles[2] = {GetStdHandle(STD_INPUT_HANDLE), wake};
+	ULONGLONG start = GetTickCount64();
+	while (true) {
+		DWORD records = 0;
+		GetNumberOfConsoleInputEvents(handles[0], &records);
+		if (_kbhit())
+			return true;
+
+		//the handle is also signalled by mouse, focus and key-up records, which _getch() skips;
+		//_kbhit() looked at every record counted above, so none of them is a key and they can go
+		INPUT_RECORD record;
+		DWORD read;
+		while (records > 0 && ReadConsoleInputW(handles[0], &record, 1, &read))
+			--records;
+
+		DWORD wait = INFINITE;
+		if (timeoutMs >= 0) {
+			ULONGLONG elapsed = GetTickCount64() - start;
+			if (elapsed >= (ULONGLONG) timeoutMs)
+				return false;
+			wait = (DWORD) (timeoutMs - elapsed);
+		}
+		if (WaitForMultipleObjects(wake ? 2 : 1, handles, FALSE, wait) != WAIT_OBJECT_0)
+			return false;
+	}
+}
+
+int windows_translateKey() {
+	int result = _getch();
 	if (result == '\r')
 		return '\n';
-	// see: http://stackoverflow.com/q/10463201
 	if (result == 0 || result == 0xE0) {
-		switch (_getch()) {
-            case 0x41:
-            case 0x48:
-                return ARROW_UP;
-            case 0x42:
-            case 0x50:
-                return ARROW_DOWN;
-            case 0x43:
-            case 0x4D:
-                return ARROW_RIGHT;
-            case 0x44:
-            case 0x4B:
-                return ARROW_LEFT;
-		}
+		int scanCode = _getch();
+		//Shift, Ctrl and Alt with F1 through F10 are three runs of consecutive scan codes
+		if (scanCode >= 0x54 && scanCode <= 0x71)
+			return (F1_KEY + (scanCode - 0x54) % 10) | (scanCode < 0x5E ? SHIFT_MOD : scanCode < 0x68 ? CTRL_MOD : ALT_MOD);
+		for (size_t i = 0; i < sizeof windowsKeys / sizeof windowsKeys[0]; ++i)
+			if (windowsKeys[i].scanCode == scanCode)
+				return windowsKeys[i].key;
+		return 0; //some key we don't know about
 	}
 
 	return result;
-#else
-    timeout(-1); // Set blocking mode
-    return posix_translateKey();
-#endif
 }
+#endif //_WIN32
 
 int ConsoleController::waitForNewKey() {
     clearKey();
@@ -305,26 +2577,398 @@ int ConsoleController::waitForNewKey() {
 
 //POSIX-only
 #ifndef _WIN32
-int posix_translateKey() {
-	int ch = getch();
-    if (ch == ERR) return 0;
-	if (ch == '\r') return '\n';
+//how long a partial escape sequence waits for its next byte before it counts as typed keys
+static const long ESCAPE_TIMEOUT_MS = 50;
+//longest run of bytes held back as a possibly-unfinished sequence
+static const size_t MAX_SEQUENCE_LENGTH = 32;
+static const char PASTE_END_SEQUENCE[] = "\x1b[201~";
+
+//escape sequences terminals send for special keys, without the leading ESC; both the CSI
+//and SS3 forms are listed, since which one arrives depends on the keypad mode
+static const struct {
+	const char* sequence;
+	int key;
+} keySequences[] = {
+	{"[A", ARROW_UP},    {"[B", ARROW_DOWN},  {"[C", ARROW_RIGHT}, {"[D", ARROW_LEFT},
+	{"OA", ARROW_UP},    {"OB", ARROW_DOWN},  {"OC", ARROW_RIGHT}, {"OD", ARROW_LEFT},
+	{"[H", HOME_KEY},    {"[F", END_KEY},     {"OH", HOME_KEY},    {"OF", END_KEY},
+	{"[1~", HOME_KEY},   {"[4~", END_KEY},    {"[7~", HOME_KEY},   {"[8~", END_KEY},
+	{"[2~", INSERT_KEY}, {"[3~", DELETE_KEY}, {"[5~", PAGE_UP},    {"[6~", PAGE_DOWN},
+	{"OP", F1_KEY},      {"OQ", F2_KEY},      {"OR", F3_KEY},      {"OS", F4_KEY},
+	{"[11~", F1_KEY},    {"[12~", F2_KEY},    {"[13~", F3_KEY},    {"[14~", F4_KEY},
+	{"[15~", F5_KEY},    {"[17~", F6_KEY},    {"[18~", F7_KEY},    {"[19~", F8_KEY},
+	{"[20~", F9_KEY},    {"[21~", F10_KEY},   {"[23~", F11_KEY},   {"[24~", F12_KEY},
+	{"[Z", '\t' | SHIFT_MOD},
+	{"[200~", PASTE_BEGIN}
+};
+
+//a byte-wise trie over keySequences, plus the xterm-style modified forms of each
+//("[1;5A" is Ctrl+Up, "[3;2~" is Shift+Delete), built once on first use
+struct KEY_TRIE {
+	struct NODE {
+		unsigned char byte;
+		int key;     //0 unless a sequence ends here
+		int child;   //first child, or -1
+		int sibling; //next child of the same parent, or -1
+	};
+	std::vector<NODE> nodes;
+
+	KEY_TRIE() {
+		NODE root = {0, 0, -1, -1};
+		nodes.push_back(root);
+
+		for (size_t i = 0; i < sizeof keySequences / sizeof keySequences[0]; ++i) {
+			std::string seq = keySequences[i].sequence;
+			int key = keySequences[i].key;
+			insert(seq, key);
+			if (key == PASTE_BEGIN || (key & SHIFT_MOD))
+				continue;
+
+			//modifier parameter is 1 + (1 for Shift, 2 for Alt, 4 for Ctrl)
+			for (int mods = 1; mods < 8; ++mods) {
+				int flags = ((mods & 1) ? SHIFT_MOD : 0) | ((mods & 2) ? ALT_MOD : 0) | ((mods & 4) ? CTRL_MOD : 0);
+				std::string param = ";" + std::to_string(mods + 1);
+				if (seq.back() == '~')
+					insert(seq.substr(0, seq.size() - 1) + param + "~", key | flags);
+				else
+					insert("[1" + param + seq.back(), key | flags);
+			}
+		}
+	}
+
+	void insert(const std::string& seq, int key) {
+		int node = 0;
+		for (size_t i = 0; i < seq.size(); ++i) {
+			int next = find(node, (unsigned char) seq[i]);
+			if (next < 0) {
+				NODE added = {(unsigned char) seq[i], 0, -1, nodes[node].child};
+				next = (int) nodes.size();
+				nodes.push_back(added);
+				nodes[node].child = next;
+			}
+			node = next;
+		}
+		if (nodes[node].key == 0) //the first (unmodified) spelling of a sequence wins
+			nodes[node].key = key;
+	}
+
+	int find(int node, unsigned char byte) const {
+		for (int child = nodes[node].child; child >= 0; child = nodes[child].sibling)
+			if (nodes[child].byte == byte)
+				return child;
+		return -1;
+	}
+};
+
+//turns raw tty bytes into keys, holding on to a partial escape sequence until the rest
+//arrives or ESCAPE_TIMEOUT_MS passes without another byte
+struct KEY_DECODER {
+	std::string pending; //undecoded bytes from the end of the last read
+	std::chrono::steady_clock::time_point lastInput;
+	bool inPaste = false;
+	bool ended = false; //stdin is at end of file or hung up
+	std::deque<int> keys;
+
+	static int translateByte(unsigned char byte) {
+		if (byte == '\r') return '\n';
+		if (byte == 0x7F) return '\b'; //most terminals send DEL for backspace
+		return byte;
+	}
+
+	void feed(const unsigned char* data, size_t length) {
+		lastInput = std::chrono::steady_clock::now();
+		pending.append((const char*) data, length);
+		decode(false);
+	}
+
+	//gives up waiting on whatever partial sequence is pending and takes it literally
+	void expire() {
+		decode(true);
+	}
+
+	//milliseconds until the pending partial sequence expires, or -1 if nothing is pending
+	long escapeWait() const {
+		if (pending.empty())
+			return -1;
+		long waited = (long) std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now() - lastInput).count();
+		return std::max(0L, ESCAPE_TIMEOUT_MS - waited);
+	}
+
+	void decode(bool final) {
+		const unsigned char* buf = (const unsigned char*) pending.data();
+		size_t length = pending.size();
+		size_t i = 0;
+		while (i < length) {
+			size_t used = inPaste ? decodePaste(buf + i, length - i, final) : decodeKey(buf + i, length - i, final);
+			if (used == 0)
+				break; //the rest is the start of a sequence, wait for more
+			i += used;
+		}
+		pending.erase(0, i);
+	}
+
+	//decodes one key from the front of buf, returning how many bytes it took (0 to wait for more)
+	size_t decodeKey(const unsigned char* buf, size_t length, bool final) {
+		static const KEY_TRIE trie;
+
+		if (buf[0] != 0x1B) {
+			keys.push_back(translateByte(buf[0]));
+			return 1;
+		}
+
+		//follow the trie as far as the bytes go
+		int node = 0;
+		size_t i = 1;
+		while (i < length) {
+			node = trie.find(node, buf[i]);
+			if (node < 0)
+				break;
+			++i;
+			if (trie.nodes[node].key != 0) {
+				keys.push_back(trie.nodes[node].key);
+				inPaste = trie.nodes[node].key == PASTE_BEGIN;
+				return i;
+			}
+		}
+		if (i == length && !final && length < MAX_SEQUENCE_LENGTH)
+			return 0; //everything so far could still become a known sequence
+
+		if (length == 1)
+			return keys.push_back(0x1B), 1; //a lone ESC really is the escape key
+
+		//skip whole CSI sequences we don't know rather than typing out their pieces
+		if (buf[1] == '[') {
+			for (size_t end = 2; end < length; ++end)
+				if (buf[end] >= 0x40 && buf[end] <= 0x7E)
+					return end + 1;
+			if (!final && length < MAX_SEQUENCE_LENGTH)
+				return 0;
+		} else if (buf[1] == 'O' && length >= 3) {
+			return 3; //likewise for unknown SS3 keys
+		}
+
+		//anything else after ESC is the terminal's way of sending Alt+key
+		if (buf[1] == 0x1B)
+			return keys.push_back(0x1B), 1;
+		keys.push_back(translateByte(buf[1]) | ALT_MOD);
+		return 2;
+	}
+
+	//pasted text is taken literally, escapes and all, up to the closing sequence
+	size_t decodePaste(const unsigned char* buf, size_t length, bool final) {
+		const size_t endLength = sizeof PASTE_END_SEQUENCE - 1;
+		if (buf[0] == 0x1B) {
+			size_t n = std::min(length, endLength);
+			if (memcmp(buf, PASTE_END_SEQUENCE, n) == 0) {
+				if (n == endLength) {
+					keys.push_back(PASTE_END);
+					inPaste = false;
+					return n;
+				}
+				if (!final)
+					return 0;
+			}
+		}
+		keys.push_back(translateByte(buf[0]));
+		return 1;
+	}
+};
+
+//what the terminal says it can do: COLORTERM is how terminals advertise 24-bit color,
+//and TERM names like xterm-256color are how terminfo tells 256-color entries apart
+ConsoleController::ColorDepth posix_probeColorDepth() {
+	const char* colorTerm = getenv("COLORTERM");
+	const char* term = getenv("TERM");
+	if (colorTerm && (strcmp(colorTerm, "truecolor") == 0 || strcmp(colorTerm, "24bit") == 0))
+		return ConsoleController::DEPTH_TRUECOLOR;
+	if (term && (strstr(term, "direct") || strstr(term, "truecolor")))
+		return ConsoleController::DEPTH_TRUECOLOR;
+	if (term && strstr(term, "256color"))
+		return ConsoleController::DEPTH_256_COLORS;
+	return ConsoleController::DEPTH_16_COLORS;
+}
+
+KEY_DECODER& posix_keyDecoder() {
+	static KEY_DECODER decoder;
+	return decoder;
+}
+
+#if defined(CONSOLECONTROLLER_ANSI) && !defined(CONSOLECONTROLLER_HEADLESS)
+//finds a reply like "\x1b[?2026;2$y" that starts with prefix and ends in final
+static bool posix_findReply(const std::string& s, const char* prefix, char final, size_t& start, size_t& end) {
+	for (start = s.find(prefix); start != std::string::npos; start = s.find(prefix, start + 1)) {
+		end = start + strlen(prefix);
+		while (end < s.size() && ((s[end] >= '0' && s[end] <= '9') || s[end] == ';' || s[end] == '$'))
+			++end;
+		if (end < s.size() && s[end] == final)
+			return ++end, true;
+	}
+	return false;
+}
+
+//asks the terminal whether it supports synchronized output (DEC mode 2026); the device
+//attributes query after it is one every terminal answers, so its reply marks the end of
+//the wait and terminals that don't know the mode cost a round trip rather than a timeout
+bool posix_probeSyncUpdates() {
+	const char query[] = "\x1b[?2026$p\x1b[c";
+	if (write(STDOUT_FILENO, query, sizeof query - 1) < 0)
+		return false;
+
+	std::string reply;
+	size_t start, end;
+	bool answered;
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(250);
+	while (!(answered = posix_findReply(reply, "\x1b[?", 'c', start, end))) {
+		long wait = (long) std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+		pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+		char buf[256];
+		ssize_t n;
+		if (wait <= 0 || poll(&pfd, 1, (int) wait) <= 0 || (n = read(STDIN_FILENO, buf, sizeof buf)) <= 0)
+			break; //no answer at all, so assume nothing
+		reply.append(buf, n);
+	}
+	if (answered)
+		reply.erase(start, end - start);
+
+	//1 and 2 are set and reset, 3 is permanently set; 0 and 4 mean it can't be used
+	bool supported = false;
+	if (posix_findReply(reply, "\x1b[?2026;", 'y', start, end)) {
+		char mode = reply[start + 8];
+		supported = mode >= '1' && mode <= '3';
+		reply.erase(start, end - start);
+	}
+
+	//anything else is input that was typed meanwhile
+	posix_keyDecoder().feed((const unsigned char*) reply.data(), reply.size());
+	return supported;
+}
+#endif
+
+//reads whatever is waiting on the tty in one go and decodes all of it,
+//returning false if nothing arrived within timeoutMs
+bool posix_readInput(long timeoutMs) {
+	KEY_DECODER& decoder = posix_keyDecoder();
+	if (decoder.ended)
+		return false;
+	pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+	if (poll(&pfd, 1, (int) timeoutMs) <= 0)
+		return false;
+
+	unsigned char buf[4096];
+	ssize_t n = read(STDIN_FILENO, buf, sizeof buf);
+	if (n < 0 && (errno == EINTR || errno == EAGAIN))
+		return false;
+	if (n <= 0) {
+		//poll() keeps reporting a closed or hung up stdin as ready, so it isn't asked again
+		decoder.ended = true;
+		decoder.expire();
+		return false;
+	}
+	decoder.feed(buf, n);
+	return true;
+}
+
+bool posix_inputEnded() {
+	return posix_keyDecoder().ended;
+}
+
+bool posix_nextKey(int& key) {
+	std::deque<int>& keys = posix_keyDecoder().keys;
+	if (keys.empty())
+		return false;
+	key = keys.front();
+	keys.pop_front();
+	return true;
+}
+
+long posix_escapeWait() {
+	return posix_keyDecoder().escapeWait();
+}
+
+void posix_expireEscape() {
+	posix_keyDecoder().expire();
+}
+
+int posix_translateKey(long timeoutMs) {
+	std::chrono::steady_clock::time_point deadline =
+		std::chrono::steady_clock::now() + std::chrono::milliseconds(std::max(timeoutMs, 0L));
+
+	int key;
+	while (!posix_nextKey(key)) {
+		if (posix_inputEnded())
+			return 0;
+		long wait = -1;
+		if (timeoutMs >= 0)
+			wait = std::max(0L, (long) std::chrono::duration_cast<std::chrono::milliseconds>(
+				deadline - std::chrono::steady_clock::now()).count());
+		long escapeWait = posix_escapeWait();
+		if (escapeWait >= 0 && (wait < 0 || escapeWait < wait))
+			wait = escapeWait;
+
+		if (!posix_readInput(wait)) {
+			if (posix_escapeWait() == 0)
+				posix_expireEscape();
+			else if (timeoutMs >= 0 && std::chrono::steady_clock::now() >= deadline)
+				return 0;
+		}
+	}
+	return key;
 }
 #endif //_WIN32
 
+#ifdef CONSOLECONTROLLER_HEADLESS
+void ConsoleController::setWindowSize(int width, int height) {
+	headlessSize = {std::max(width, 1), std::max(height, 1)};
+	if (classInstances == 0)
+		return; //the constructor picks it up
+
+	freeBuffers();
+	bufferSize = headlessSize;
+	allocateBuffers();
+	termCursor = {-1, -1};
+	clearTerminal(0);
+}
+
+void ConsoleController::pushInput(std::string_view bytes) {
+	posix_keyDecoder().feed((const unsigned char*) bytes.data(), bytes.size());
+}
+
+void ConsoleController::pushKey(int key) {
+	posix_keyDecoder().keys.push_back(key);
+}
+
+char32_t ConsoleController::getGlyphAt(int x, int y) {
+	if (x < 0 || y < 0 || x >= bufferSize.x || y >= bufferSize.y)
+		return 0;
+	char32_t codepoints[MAX_CLUSTER_LENGTH];
+	clusterCodepoints(frontBuffer.glyphs[y * bufferStride + x], codepoints);
+	return codepoints[0];
+}
+
+ConsoleController::COLOR_ID ConsoleController::getColorAt(int x, int y) {
+	if (x < 0 || y < 0 || x >= bufferSize.x || y >= bufferSize.y)
+		return 0;
+	return frontBuffer.colors[y * bufferStride + x];
+}
+#endif
+
 void ConsoleController::waitForKey(int match) {
-    while (waitForKey() != match);
+    int key;
+    while ((key = waitForKey()) != match && key != 0); //0 once input has ended
 }
 
 int ConsoleController::echoKey() {
     int i = waitForKey();
-    output((char)i);
+    if (i != 0 && i < 0x100) //only keys that are characters can be echoed
+        output((char)i);
     return i;
 }
 
 /////////////////////////////////////////////////
 
 void ConsoleController::sleepMs(long ms) {
+	present();
 #ifdef _WIN32
 	Sleep(ms);
 #else
@@ -334,16 +2978,108 @@ void ConsoleController::sleepMs(long ms) {
 }
 
 void ConsoleController::throttle(long ms) {
-	if (throttleInitialized) {
-		throttleLast += ms / 1000.0 * CLOCKS_PER_SEC;
-		// throttleLast is now the next throttle point until we sleep
-		if (throttleLast > clock())
-			sleepMs(throttleLast - clock());
+	present();
+	if (throttlePacer.getFrameTime() != std::chrono::milliseconds(ms))
+		throttlePacer.setFrameTime(std::chrono::milliseconds(ms));
+	throttlePacer.wait();
+}
+
+/////////////////////////////////////////////////
+
+//the shortest and longest the spin at the end of a wait is allowed to be
+static const std::chrono::microseconds MIN_SPIN_TIME(200);
+#ifdef _WIN32
+static const std::chrono::milliseconds MAX_SPIN_TIME(16); //Sleep() has a 15.6ms tick by default
+#else
+static const std::chrono::milliseconds MAX_SPIN_TIME(4);
+#endif
+
+ConsoleController::FramePacer::FramePacer(double fps) {
+	spinTime = std::chrono::milliseconds(1);
+	reset();
+	resetStats();
+	setTargetFps(fps);
+}
+
+//slower rates are held at one frame an hour, so the frame time always fits
+static const double MIN_TARGET_FPS = 1.0 / 3600;
+
+void ConsoleController::FramePacer::setTargetFps(double fps) {
+	if (!(fps > 0)) //NaN too
+		setFrameTime(std::chrono::nanoseconds::zero());
+	else
+		setFrameTime(std::chrono::nanoseconds((long long) (1e9 / std::max(fps, MIN_TARGET_FPS))));
+}
+
+void ConsoleController::FramePacer::setFrameTime(std::chrono::nanoseconds frameTime) {
+	frameTime = std::max(frameTime, std::chrono::nanoseconds::zero());
+	this->frameTime = std::chrono::duration_cast<CLOCK::duration>(frameTime);
+	//the grid moves to the new rate from the last frame rather than jumping
+	if (started)
+		nextFrame = lastFrame + this->frameTime;
+}
+
+std::chrono::nanoseconds ConsoleController::FramePacer::getFrameTime() const {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(frameTime);
+}
+
+void ConsoleController::FramePacer::wait() {
+	if (!started) {
+		started = true;
+		lastFrame = CLOCK::now();
+		nextFrame = lastFrame + frameTime;
+		return;
 	}
-	else {
-		throttleLast = clock();
-		throttleInitialized = true;
+
+	CLOCK::time_point now = CLOCK::now();
+	if (now >= nextFrame) {
+		if (frameTime > CLOCK::duration::zero()) //an unpaced frame can't be late
+			++stats.missed;
+		//a frame or more behind: start over rather than rushing out frames to catch up
+		if (now - nextFrame >= frameTime)
+			nextFrame = now;
+	} else {
+		//sleep until just short of the deadline, then spin the rest
+		CLOCK::time_point wake = nextFrame - spinTime;
+		if (wake > now) {
+			std::this_thread::sleep_until(wake);
+			now = CLOCK::now();
+
+			//learn how much sleeps overshoot here, so the next one stops early enough,
+			//and slowly shrink the margin back down when they don't
+			CLOCK::duration over = now - wake;
+			if (over > spinTime)
+				spinTime = std::min<CLOCK::duration>(over + over / 4, MAX_SPIN_TIME);
+			else
+				spinTime = std::max<CLOCK::duration>(spinTime - spinTime / 16, MIN_SPIN_TIME);
+		}
+		while (now < nextFrame) {
+			std::this_thread::yield();
+			now = CLOCK::now();
+		}
 	}
+
+	double ms = std::chrono::duration<double, std::milli>(now - lastFrame).count();
+	++stats.frames;
+	stats.lastMs = ms;
+	stats.averageMs += (ms - stats.averageMs) / stats.frames;
+	stats.minMs = stats.frames == 1 ? ms : std::min(stats.minMs, ms);
+	stats.maxMs = std::max(stats.maxMs, ms);
+
+	lastFrame = now;
+	nextFrame += frameTime;
+}
+
+void ConsoleController::FramePacer::reset() {
+	started = false;
+}
+
+ConsoleController::FramePacer::FRAME_STATS ConsoleController::FramePacer::getStats() const {
+	return stats;
+}
+
+void ConsoleController::FramePacer::resetStats() {
+	stats = FRAME_STATS();
 }
 
 /////////////////////////////////////////////////
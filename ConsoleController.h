@@ -2,42 +2,97 @@
 //Handles input, output, text coloring, and waiting/time controls
 //Targets Windows and POSIX systems
 //
+//On POSIX the default backend is curses; define CONSOLECONTROLLER_ANSI when
+//building to write VT escape sequences straight to the terminal instead
+//
+//Define CONSOLECONTROLLER_HEADLESS (POSIX only) to render into memory with no
+//terminal at all, for tests and benchmarks; see the Headless section below
+//
+//Define CONSOLECONTROLLER_NO_GLOBAL to leave out the shared con instance
+//
 
 #ifndef CONSOLECONTROLLER_H_INCLUDED
 #define CONSOLECONTROLLER_H_INCLUDED
 
 //General includes
-#include <ctime>   //temporal methods
-#include <string>  //input and output
-#include <sstream> //output
+#include <charconv>    //number output
+#include <chrono>      //temporal methods
+#include <ctime>       //temporal methods
+#include <string>      //input and output
+#include <string_view> //output
+#include <sstream>     //output
+#include <type_traits> //number output
+
+#ifdef _WIN32
+#undef CONSOLECONTROLLER_HEADLESS //the headless backend is POSIX-only
+#endif
+#ifdef CONSOLECONTROLLER_HEADLESS
+#define CONSOLECONTROLLER_ANSI //headless produces exactly what the ANSI backend would, minus the tty
+#endif
 
 #ifdef _WIN32
 //Windows-specific includes
+#ifndef NOMINMAX
+#define NOMINMAX //keep std::min and std::max usable
+#endif
 #include <Windows.h>
 #include <conio.h>
-#include <iostream>
+#undef KEY_EVENT //WinCon.h's input record type, which would clash with ConsoleController::KEY_EVENT
 
-//Color flags to simulate a POSIX-like color implementation
+//Color flags to simulate a POSIX-like color implementation, in the same (palette) order
 enum Colors {
-    COLOR_BLACK,  COLOR_RED,     COLOR_GREEN, COLOR_BLUE,
-    COLOR_YELLOW, COLOR_MAGENTA, COLOR_CYAN,  COLOR_WHITE
+    COLOR_BLACK, COLOR_RED,     COLOR_GREEN, COLOR_YELLOW,
+    COLOR_BLUE,  COLOR_MAGENTA, COLOR_CYAN,  COLOR_WHITE
 };
 
-//special (non-ascii) key codes
-//obviously this is not fully implemented
-enum SpecialKeyCodes {
-    ARROW_LEFT  = 0x00000100,
-    ARROW_RIGHT = 0x00000101,
-    ARROW_DOWN  = 0x00000102,
-    ARROW_UP    = 0x00000103
+#elif defined(CONSOLECONTROLLER_ANSI)
+//ANSI backend includes
+#include <csignal>
+#include <termios.h>
+#include <unistd.h>
+
+//Color numbers as used by SGR, matching the values curses uses
+enum Colors {
+    COLOR_BLACK, COLOR_RED,     COLOR_GREEN, COLOR_YELLOW,
+    COLOR_BLUE,  COLOR_MAGENTA, COLOR_CYAN,  COLOR_WHITE
 };
 
 #else
 
 #include <curses.h>
+#define CONSOLECONTROLLER_CURSES
 
 #endif // _WIN32
 
+#ifdef _WIN32
+#undef CONSOLECONTROLLER_ANSI //the escape-sequence backend is POSIX-only
+#endif
+
+//special (non-ascii) key codes, as returned by getKey() and friends
+enum SpecialKeyCodes {
+    ARROW_LEFT  = 0x00000100,
+    ARROW_RIGHT = 0x00000101,
+    ARROW_DOWN  = 0x00000102,
+    ARROW_UP    = 0x00000103,
+    HOME_KEY    = 0x00000104,
+    END_KEY     = 0x00000105,
+    PAGE_UP     = 0x00000106,
+    PAGE_DOWN   = 0x00000107,
+    INSERT_KEY  = 0x00000108,
+    DELETE_KEY  = 0x00000109,
+    F1_KEY      = 0x00000111, //F2_KEY through F12_KEY follow in order
+    F2_KEY, F3_KEY, F4_KEY, F5_KEY, F6_KEY, F7_KEY, F8_KEY, F9_KEY, F10_KEY, F11_KEY, F12_KEY,
+
+    //pasted text arrives as ordinary keys between these two
+    PASTE_BEGIN = 0x00000120,
+    PASTE_END   = 0x00000121,
+
+    //modifier flags, combined with the codes above (or with plain keys, for Alt)
+    SHIFT_MOD   = 0x00001000,
+    ALT_MOD     = 0x00002000,
+    CTRL_MOD    = 0x00004000
+};
+
 
 class ConsoleController {
     public:
@@ -47,74 +102,165 @@ class ConsoleController {
         typedef struct COORD_2D {
             int x, y;
         } COORD2D, COORD2;
+        typedef struct RECT_2D {
+            int x, y, width, height;
+        } RECT_2D;
+        typedef struct KEY_EVENT {
+            int key; //same values getKey() returns
+        } KEY_EVENT;
+
+        //how many colors the console can show, see getColorDepth()
+        enum ColorDepth {
+            DEPTH_16_COLORS  = 16,
+            DEPTH_256_COLORS = 256,
+            DEPTH_TRUECOLOR  = 0x1000000
+        };
+
+        //the lines drawBox() draws with
+        enum BoxStyle {
+            BOX_ASCII,   //+-|
+            BOX_SINGLE,  //light box drawing lines
+            BOX_DOUBLE,
+            BOX_HEAVY,
+            BOX_ROUNDED  //light lines with rounded corners
+        };
 
         // Setup and teardown
         ConsoleController();
         ~ConsoleController();
         void initColor(COLOR_ID colorId, int fg, int bg, bool fBold, bool bBold);
 
+        //fg and bg are -1 for the console's own color, a palette index (0-255, numbered the
+        //way xterm does: 0-7 in SGR order, 8-15 bright, then a 6x6x6 cube and a gray ramp),
+        //or rgb(r, g, b); colors the console can't show become the nearest one it can
+        void initColor(COLOR_ID colorId, int fg, int bg);
+        static constexpr int rgb(int r, int g, int b) {
+            return RGB_FLAG | (r & 0xFF) << 16 | (g & 0xFF) << 8 | (b & 0xFF);
+        }
+        static const int RGB_FLAG = 0x1000000;
+
+        //probed from COLORTERM/TERM, or curses' COLORS; setting it again redoes every color
+        ColorDepth getColorDepth();
+        void setColorDepth(ColorDepth depth);
+
         // Accessors
         COORD_2D getWindowSize();
         COORD_2D getCurPos();
 
+        //output is UTF-8, and each character takes up as many cells as it is wide:
+        //0 for combining marks and other characters drawn onto their neighbor, which join its cell,
+        //2 for CJK, emoji and other wide characters, 1 for everything else
+        static int glyphWidth(char32_t codepoint);
+
         // Actions
         void cls();
+
+        //moves rows top to bottom (inclusive) up by n lines, or down for a negative n, and
+        //blanks the rows that come free in the current color; present() has the console
+        //scroll them itself instead of sending every row again
+        void scrollRegion(int top, int bottom, int n);
+
         void moveCursor(int x, int y);
         void moveCursor(COORD_2D pos);
         void color(COLOR_ID);
+        void present();
+        void flush();
+
+        //output between beginFrame() and endFrame() reaches the console as a single update,
+        //which terminals that support synchronized output also paint all at once
+        //(frames nest, and present() waits for the outermost endFrame())
+        void beginFrame();
+        void endFrame();
+
+        //everything written is tracked, so present() only looks at rows and columns that
+        //changed; these make it send an area again even if it looks unchanged, e.g. after
+        //something else has drawn over the console
+        void invalidate(RECT_2D rect);
+        void invalidate();
+        void setOutputBufferSize(size_t bytes);
 
         //fix for the commonly distributed GCC bug with std::to_string()
+        //numbers skip the stream entirely, only other types pay for one
         template <typename TYPE>
         std::string toString(TYPE t) {
-            std::stringstream ss;
-            ss << t;
-            return ss.str();
+            if constexpr (isNumber<TYPE>()) {
+                char buf[NUMBER_LENGTH];
+                return std::string(buf, formatNumber(buf, t));
+            } else {
+                std::stringstream ss;
+                ss << t;
+                return ss.str();
+            }
         }
 
         // Output
-        void output(std::string s);
+        //text is copied straight from the caller's memory into the screen buffer
+        void output(std::string_view s);
+        void output(const std::string& s);
+        void output(const char* s);
+        void output(const char* s, size_t length);
+        void output(char c);
 
         template <typename TYPE>
-        void output(TYPE t) {
-#ifdef _WIN32 //slight performance improvement for Windows
-            std::cout << t; //avoids expensive stringstream construction
-#else
-            output(toString(t));
-#endif // _WIN32
+        void output(const TYPE& t) {
+            if constexpr (isNumber<TYPE>()) {
+                char buf[NUMBER_LENGTH]; //formatted on the stack, straight into the screen buffer
+                putChars(buf, formatNumber(buf, t));
+            } else if constexpr (std::is_convertible<const TYPE&, std::string_view>::value) {
+                output(std::string_view(t));
+            } else {
+                output(toString(t));
+            }
         }
 
         template <typename TYPE>
-        void output(COLOR_ID c, TYPE t) {
+        void output(COLOR_ID c, const TYPE& t) {
             color(c);
             output(t);
         }
 
         template <typename TYPE>
-        void output(int x, int y, TYPE t) {
+        void output(int x, int y, const TYPE& t) {
             moveCursor(x, y);
             output(t);
         }
 
         template <typename TYPE>
-        void output(COORD_2D pos, TYPE t) {
+        void output(COORD_2D pos, const TYPE& t) {
             moveCursor(pos);
             output(t);
         }
 
         template <typename TYPE>
-        void output(int x, int y, COLOR_ID c, TYPE t) {
+        void output(int x, int y, COLOR_ID c, const TYPE& t) {
             moveCursor(x, y);
             color(c);
             output(t);
         }
 
         template <typename TYPE>
-        void output(COORD_2D pos, COLOR_ID c, TYPE t) {
+        void output(COORD_2D pos, COLOR_ID c, const TYPE& t) {
             moveCursor(pos);
             color(c);
             output(t);
         }
 
+        // Drawing
+        //these write a character one cell wide straight into the screen buffer, a row at a
+        //time, leaving the cursor and current color alone; anything off the screen is left out
+        void fill(RECT_2D rect, char32_t glyph, COLOR_ID colorId);
+        void drawHLine(int x, int y, int length, char32_t glyph, COLOR_ID colorId);
+        void drawVLine(int x, int y, int length, char32_t glyph, COLOR_ID colorId);
+        void drawBox(RECT_2D rect, BoxStyle style, COLOR_ID colorId);
+
+        // Views
+        //a part of the screen with coordinates of its own, which everything drawn through it
+        //is clipped to; views over separate parts of the screen can be drawn from separate
+        //threads at once, as long as they were all made first and nothing else writes to
+        //the screen or presents meanwhile
+        class View;
+        View view(RECT_2D area);
+
         // Input
         int getKey();
         int waitForKey();
@@ -127,6 +273,13 @@ class ConsoleController {
         std::string waitForInput(char delimiter);
         std::string waitForInput(std::string delimiter);
 
+        //keys can optionally be read on a background thread as they arrive,
+        //so nothing is lost during long frames and rendering never waits on the console
+        void startInputThread();
+        void stopInputThread();
+        bool pollEvent(KEY_EVENT& event);
+        bool waitEvent(KEY_EVENT& event, long timeoutMs);
+
         // Type-specific input
         template <typename TYPE>
         TYPE waitForInput(std::string delimiters) {
@@ -151,15 +304,64 @@ class ConsoleController {
 
         // Temporal methods (consider moving to a different file)
         void sleepMs(long ms);
-        void throttle(long ms);
+        void throttle(long ms); //present(), then wait until ms after the last throttle()
+
+        //paces a loop at a fixed frame rate using the monotonic clock
+        //deadlines sit on a fixed grid, so time lost in one frame is made up in the next
+        //instead of accumulating; if a whole frame is missed the grid restarts from now
+        class FramePacer {
+            public:
+                //frame times are measured from one wait() returning to the next
+                struct FRAME_STATS {
+                    unsigned long frames; //wait() calls measured since the last resetStats()
+                    unsigned long missed; //frames that were already late when wait() was called
+                    double lastMs, averageMs, minMs, maxMs;
+                };
+
+                explicit FramePacer(double fps = 60);
+                void setTargetFps(double fps); //0 or less turns pacing off; wait() then only measures
+                void setFrameTime(std::chrono::nanoseconds frameTime);
+                std::chrono::nanoseconds getFrameTime() const;
+
+                //blocks until the next frame is due: sleeps most of the way,
+                //then spins for the last stretch since sleeps tend to overshoot
+                void wait();
+                void reset(); //the next wait() returns at once and starts a new grid
+
+                FRAME_STATS getStats() const;
+                void resetStats();
+
+            private:
+                typedef std::chrono::steady_clock CLOCK;
+
+                CLOCK::duration frameTime;
+                CLOCK::duration spinTime; //how early to stop sleeping, learned from oversleeps
+                CLOCK::time_point nextFrame, lastFrame;
+                bool started;
+                FRAME_STATS stats;
+        };
 
         // Utility methods
         void clearKey();
         void pause();
 
+#ifdef CONSOLECONTROLLER_HEADLESS
+        // Headless
+        //the screen is an in-memory grid (80x24 until resized) and output goes nowhere;
+        //input comes only from the script, and reading past its end returns 0 at once
+        void setWindowSize(int width, int height); //also blanks the screen
+        void pushInput(std::string_view bytes);    //raw bytes, as a terminal would send them
+        void pushKey(int key);                     //an already decoded key code
+
+        //what the last present() put on the screen (the second cell of a wide character has glyph 0,
+        //and a character made of several code points gives the first)
+        char32_t getGlyphAt(int x, int y);
+        COLOR_ID getColorAt(int x, int y);
+#endif
+
         // Operator overloads
         template<typename TYPE>
-        ConsoleController& operator<< (TYPE t) {
+        ConsoleController& operator<< (const TYPE& t) {
             output(t);
             return *this;
         }
@@ -172,16 +374,167 @@ class ConsoleController {
 
 
     private:
+        // Number formatting
+        static const int NUMBER_LENGTH = 64; //enough for any integer or %g-formatted floating point
+
+        //everything arithmetic except the character types, which streams print as characters
+        template <typename TYPE>
+        static constexpr bool isNumber() {
+            return std::is_arithmetic<TYPE>::value &&
+                !std::is_same<TYPE, bool>::value     && !std::is_same<TYPE, char>::value     &&
+                !std::is_same<TYPE, signed char>::value && !std::is_same<TYPE, unsigned char>::value &&
+                !std::is_same<TYPE, wchar_t>::value  && !std::is_same<TYPE, char16_t>::value &&
+                !std::is_same<TYPE, char32_t>::value;
+        }
+
+        //formats the same way a default std::stringstream would, returning the length
+        template <typename TYPE>
+        static size_t formatNumber(char* buf, TYPE t) {
+            std::to_chars_result result;
+            if constexpr (std::is_floating_point<TYPE>::value)
+                result = std::to_chars(buf, buf + NUMBER_LENGTH, t, std::chars_format::general, 6);
+            else
+                result = std::to_chars(buf, buf + NUMBER_LENGTH, t);
+            return result.ptr - buf;
+        }
+
         // Define types
+        //a color as given to initColor(), in the extended form (see rgb())
         struct COLOR {
-            short foreground, background;
-            bool foreBold, backBold;
+            int foreground, background;
+            bool bold;
+        };
+
+        //a screen's worth of cells, one plane per property so that fills and scans only touch
+        //the memory they need; cell (x, y) is at index y * bufferStride + x in each plane
+        struct PLANES {
+            char32_t* glyphs;
+            COLOR_ID* colors;
+            unsigned char* attributes; //CELL_FLAGS, 0 for plain text
+        };
+
+        enum CELL_FLAGS {
+            CELL_WIDE         = 1, //holds a character two cells wide
+            CELL_CONTINUATION = 2  //the second cell of the wide character to its left
+        };
+
+        //a front buffer glyph that never matches, for cells whose content on the console is unknown
+        static constexpr char32_t UNKNOWN_GLYPH = 0xFFFFFFFF;
+        static constexpr char32_t REPLACEMENT_GLYPH = 0xFFFD; //what invalid UTF-8 comes out as
+
+        //a glyph with the high bit set is a handle into clusterPool, for a character made of
+        //several code points: one with combining marks, a flag, or emoji joined into one
+        static constexpr char32_t CLUSTER_BIT = 0x80000000;
+        static const int MAX_CLUSTER_LENGTH = 8; //code points, any more are dropped
+        struct CLUSTER_POOL; //defined in the source file
+
+        //a UTF-8 sequence that output has only partly been given so far
+        struct UTF8_STATE {
+            char32_t codepoint, minimum; //the bits so far, and the least that isn't overlong
+            int remaining;               //continuation bytes still to come
+        };
+
+        // Input helpers
+        struct INPUT_QUEUE; //defined in the source file, along with the thread it belongs to
+        int readKey(long timeoutMs);
+        int waitKey(long timeoutMs);
+
+        struct SCROLL {
+            int top, bottom, n;
+            COLOR_ID color; //of the rows that come free
+        };
+        static const int MAX_PENDING_SCROLLS = 16;
+
+        //the changed part of a row, empty when start >= end
+        struct SPAN {
+            int start, end;
         };
 
+        // Screen buffer helpers
+        void allocateBuffers();
+        void freeBuffers();
+        void followWindowSize();
+        static COORD_2D consoleSize();
+        static void markDirty(int y, int start, int end);
+        void markAllDirty();
+        static void fillCells(PLANES& planes, size_t index, size_t count, char32_t glyph, COLOR_ID color);
+        void copyCells(PLANES& to, const PLANES& from, size_t index, size_t count);
+        bool cellChanged(size_t index);
+        static SPAN splitWide(int y, int start, int end, int left, int right);
+        static bool decodeUtf8(UTF8_STATE& state, unsigned char c, char32_t& codepoint, bool& consumed);
+        void putGlyph(char32_t codepoint);
+        static char32_t extendCluster(size_t index, char32_t codepoint, int width, bool maySweep, bool& flag);
+        bool joinCluster(char32_t codepoint, int width);
+        void placeGlyph(char32_t glyph, int width);
+        static char32_t internCluster(const char32_t* codepoints, int length, bool maySweep);
+        static int clusterCodepoints(char32_t glyph, char32_t* codepoints);
+        static size_t sweepClusters();
+        void putChar(char c);
+        void putChars(const char* s, size_t length);
+        void shiftRows(PLANES& planes, const SCROLL& scroll);
+        void emitScroll(const SCROLL& scroll);
+        void emitRun(int x, int y, int n);
+        void emitText(const char* text, int length);
+        void emitMove(int x, int y);
+        void applyColor(COLOR_ID colorId);
+        void compileColor(COLOR_ID colorId);
+        bool clearIsCheaper();
+        void clearTerminal(COLOR_ID colorId);
+#ifdef CONSOLECONTROLLER_ANSI
+        void openSync();
+#ifndef CONSOLECONTROLLER_HEADLESS
+        static void catchSignals(bool catching);
+        static void onSignal(int signal);
+        static void restoreTerminal();
+        static void restoreAtExit();
+#endif
+#endif
+#ifndef CONSOLECONTROLLER_CURSES
+        void appendOutput(const char* data, size_t length);
+        void appendOutput(const char* str);
+        static void writeOutput(const char* data, size_t length);
+#endif
+
         // Fields
-        clock_t throttleLast;
-        bool throttleInitialized;
+        FramePacer throttlePacer;
         static int classInstances;
+        static INPUT_QUEUE* inputQueue; //only while the input thread is running
+
+        //the screen model is shared by every instance, just like the terminal itself
+        //output goes into backBuffer and present() sends the difference from frontBuffer
+        //(plain pointers so they are usable before dynamic initialization, e.g. from con)
+        static PLANES backBuffer;
+        static PLANES frontBuffer;
+        static int bufferStride; //cells from one row to the next, rounded up so rows stay aligned
+        static SPAN* dirtySpans; //one per row, what present() has to compare
+        static COORD_2D bufferSize;
+        static COORD_2D cursorPos;
+        static COLOR_ID activeColor;
+        static UTF8_STATE utf8State;
+        static CLUSTER_POOL* clusterPool;
+        static int pendingClear; //color of a cls() present() hasn't dealt with yet, or -1
+        static int frameDepth; //beginFrame() calls that haven't been ended yet
+
+        //scrollRegion() calls already applied to backBuffer, which present() still has to
+        //apply to frontBuffer and the console
+        static SCROLL pendingScrolls[MAX_PENDING_SCROLLS];
+        static int pendingScrollCount;
+
+        //what the console itself currently has, so redundant moves and color changes can
+        //be skipped ({-1, -1} and -1 when unknown)
+        static COORD_2D termCursor;
+        static int termColor;
+
+        //every color as it was defined, and the console's color depth it gets reduced to
+        static COLOR colors[256];
+        static ColorDepth colorDepth;
+
+#ifndef CONSOLECONTROLLER_CURSES
+        //text and escape sequences queue up here and go out in as few writes as possible,
+        //either when the buffer fills or on flush()
+        static char* outBuffer;
+        static size_t outLength, outCapacity;
+#endif
 
         // Disallow copying and assigning over the object (do not implement these methods)
         ConsoleController(const ConsoleController &);
@@ -191,14 +544,137 @@ class ConsoleController {
 #ifdef _WIN32
         // Windows specific fields
         static HANDLE hStdout;
-        static COLOR colors[256];
+        static bool consoleOutput;        //false when stdout is redirected to a file or pipe
+        static WORD colorAttributes[256]; //ready for SetConsoleTextAttribute()
+        static WORD defaultAttributes;    //what the console had before we started
+        static UINT savedOutputCP;        //the code page it had, before we switched it to UTF-8
+#elif defined(CONSOLECONTROLLER_ANSI)
+        // ANSI backend fields
+        struct SGR_CODE {
+            char bytes[47]; //the escape sequence that switches to a color, ready to send
+            unsigned char length;
+        };
+        static SGR_CODE sgrCodes[256];
+        static termios savedTermios;
+#ifndef CONSOLECONTROLLER_HEADLESS
+        static termios rawTermios;            //what the constructor switched to, again after a stop
+        static volatile sig_atomic_t resumed; //continued after a stop, so the screen needs redrawing
+#endif
+        static bool syncUpdates; //the terminal supports synchronized output (DEC mode 2026)
+        static bool syncOpen;    //an update has been started and not yet ended
+#ifdef CONSOLECONTROLLER_HEADLESS
+        static COORD_2D headlessSize;
+#endif
 #else
         // POSIX specific fields
-        static bool foreBoldFlags[256];
+        static attr_t colorAttributes[256]; //ready for attrset()
+        static bool syncUpdates; //terminfo has Sync, i.e. synchronized output (DEC mode 2026)
 #endif
 };
 
-//declare a static instance available everywhere, similar to std::cout
-static ConsoleController con;
+//a rectangle of the screen, as made by ConsoleController::view() or View::view(); (0, 0) is
+//its top left corner, and text that runs off its right edge is cut off rather than wrapped
+//each view has a cursor and color of its own, starting at (0, 0) in the color current
+//when it was made
+class ConsoleController::View {
+    public:
+        View view(RECT_2D area) const; //a part of this view, in its coordinates
+        COORD_2D getSize() const;
+        COORD_2D getCurPos() const;
+
+        void moveCursor(int x, int y);
+        void moveCursor(COORD_2D pos);
+        void color(COLOR_ID colorId);
+
+        // Drawing
+        void fill(RECT_2D rect, char32_t glyph, COLOR_ID colorId);
+        void drawHLine(int x, int y, int length, char32_t glyph, COLOR_ID colorId);
+        void drawVLine(int x, int y, int length, char32_t glyph, COLOR_ID colorId);
+        void drawBox(RECT_2D rect, BoxStyle style, COLOR_ID colorId);
+
+        // Output
+        void output(std::string_view s);
+        void output(const std::string& s);
+        void output(const char* s);
+        void output(const char* s, size_t length);
+        void output(char c);
+
+        template <typename TYPE>
+        void output(const TYPE& t) {
+            if constexpr (isNumber<TYPE>()) {
+                char buf[NUMBER_LENGTH];
+                putChars(buf, formatNumber(buf, t));
+            } else if constexpr (std::is_convertible<const TYPE&, std::string_view>::value) {
+                output(std::string_view(t));
+            } else {
+                std::stringstream ss;
+                ss << t;
+                output(ss.str());
+            }
+        }
+
+        template <typename TYPE>
+        void output(COLOR_ID c, const TYPE& t) {
+            color(c);
+            output(t);
+        }
+
+        template <typename TYPE>
+        void output(int x, int y, const TYPE& t) {
+            moveCursor(x, y);
+            output(t);
+        }
+
+        template <typename TYPE>
+        void output(COORD_2D pos, const TYPE& t) {
+            moveCursor(pos);
+            output(t);
+        }
+
+        template <typename TYPE>
+        void output(int x, int y, COLOR_ID c, const TYPE& t) {
+            moveCursor(x, y);
+            color(c);
+            output(t);
+        }
+
+        template <typename TYPE>
+        void output(COORD_2D pos, COLOR_ID c, const TYPE& t) {
+            moveCursor(pos);
+            color(c);
+            output(t);
+        }
+
+        template<typename TYPE>
+        View& operator<< (const TYPE& t) {
+            output(t);
+            return *this;
+        }
+
+    private:
+        friend class ConsoleController;
+        View(RECT_2D area, int left, int top, int right, int bottom);
+
+        void putChars(const char* s, size_t length);
+        void putGlyph(char32_t codepoint);
+        void placeGlyph(char32_t glyph, int width);
+        void touch(int y, SPAN span);
+        void markWritten();
+
+        COORD_2D origin, size; //where (0, 0) is on the screen, and how far the view reaches from there
+        int clipLeft, clipTop, clipRight, clipBottom; //the part of the screen it may write to
+        COORD_2D cursorPos;    //in view coordinates, and free to be outside the view
+        COLOR_ID activeColor;
+        UTF8_STATE utf8State;
+
+        //what the call in progress has written, which it marks dirty in one go when it is done
+        int writtenLeft, writtenTop, writtenRight, writtenBottom;
+};
+
+#ifndef CONSOLECONTROLLER_NO_GLOBAL
+//a single shared instance available everywhere, similar to std::cout
+//(defined in ConsoleController.cpp, so including this header doesn't take over the terminal)
+extern ConsoleController con;
+#endif
 
 #endif // CONSOLECONTROLLER_H_INCLUDED
@@ -0,0 +1,214 @@
+//Rendering benchmark for ConsoleController
+//Drives the output, color, cursor and cls paths against a pseudo-terminal and reports
+//ns per call, bytes sent per frame and write syscalls per frame for a few typical workloads
+//
+//Build from the repository root (drop -lncurses when adding -DCONSOLECONTROLLER_ANSI):
+//  g++ -O2 -std=c++17 -DCONSOLECONTROLLER_NO_GLOBAL -I. bench/ConsoleControllerBench.cpp ConsoleController.cpp -pthread -lutil -lncurses -o ccbench
+//Run:
+//  ./ccbench [frames] [width] [height]
+//
+
+#include "ConsoleController.h"
+
+#include <atomic>  //pty byte count
+#include <chrono>  //timing
+#include <cstdio>  //results
+#include <cstdlib> //arguments
+#include <fstream> //syscall counts
+#include <string>
+#include <thread>  //pty reader
+
+#include <sys/ioctl.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <util.h>
+#else
+#include <pty.h>
+#endif
+
+#ifndef CONSOLECONTROLLER_NO_GLOBAL
+#error "build the benchmark with -DCONSOLECONTROLLER_NO_GLOBAL, so the pty is ready before the console is taken over"
+#endif
+
+typedef std::chrono::steady_clock CLOCK;
+
+//the terminal side of the pty: reads everything the controller sends so it never blocks
+static std::atomic<unsigned long long> ptyBytes(0);
+
+static void drainPty(int master) {
+	char buf[65536];
+	ssize_t n;
+	while ((n = read(master, buf, sizeof buf)) > 0)
+		ptyBytes += n;
+}
+
+//write syscalls made by this process so far, or -1 where the kernel doesn't say
+static long long writeSyscalls() {
+	std::ifstream io("/proc/self/io");
+	std::string name;
+	long long value;
+	while (io >> name >> value)
+		if (name == "syscw:")
+			return value;
+	return -1;
+}
+
+//small deterministic generator, so every run draws the same frames
+static unsigned int nextRandom() {
+	static unsigned int state = 2463534242u;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+struct RESULT {
+	const char* name;
+	long long ops, frames;
+	double drawNs, presentNs; //totals
+	unsigned long long bytes;
+	long long writes;
+};
+
+// Scenarios
+//each draws one frame and returns how many library calls it made
+
+//every cell rewritten with a random character in a random color
+static long long fullScreenRandom(ConsoleController& con, int) {
+	ConsoleController::COORD_2D size = con.getWindowSize();
+	for (int y = 0; y < size.y; ++y) {
+		for (int x = 0; x < size.x; ++x) {
+			unsigned int r = nextRandom();
+			con.moveCursor(x, y);
+			con.color(1 + r % 8);
+			con.output((char) ('!' + (r >> 8) % 94));
+		}
+	}
+	return 3LL * size.x * size.y;
+}
+
+//a few log lines per frame, scrolling the whole screen up
+static long long scrollingLog(ConsoleController& con, int frame) {
+	for (int i = 0; i < 4; ++i) {
+		con.color(1 + (frame + i) % 8);
+		con << "[" << frame << "." << i << "] request served in " << (nextRandom() % 1000) / 10.0 << "ms\n";
+	}
+	return 4 * 7;
+}
+
+//a handful of counters changing on an otherwise static screen
+static long long sparseUpdates(ConsoleController& con, int frame) {
+	ConsoleController::COORD_2D size = con.getWindowSize();
+	for (int i = 0; i < 16; ++i) {
+		unsigned int r = nextRandom();
+		con.output((int) (r % (size.x - 8)), (int) ((r >> 16) % size.y), 1 + i % 8, frame);
+	}
+	return 16;
+}
+
+//a table where every field has its own color, with most values changing each frame
+static long long colorTable(ConsoleController& con, int frame) {
+	ConsoleController::COORD_2D size = con.getWindowSize();
+	long long ops = 0;
+	for (int row = 0; row < size.y; ++row) {
+		for (int col = 0; col + 10 <= size.x; col += 10) {
+			con.output(col, row, 1 + (row + col / 10 + frame) % 8, (row * 31 + col + frame * 7) % 100000);
+			con.output(' ');
+			ops += 2;
+		}
+	}
+	return ops;
+}
+
+//cls() and a short page of text, like a menu being redrawn
+static long long clearAndRedraw(ConsoleController& con, int frame) {
+	con.cls();
+	for (int i = 0; i < 10; ++i)
+		con.output(2, 2 + i, 1 + (i + frame) % 8, "menu item number ");
+	return 11;
+}
+
+static RESULT run(ConsoleController& con, const char* name, long long (*scenario)(ConsoleController&, int), int frames) {
+	RESULT result = {name, 0, frames, 0, 0, 0, 0};
+
+	//start every scenario from the same blank, fully presented screen
+	con.color(0);
+	con.cls();
+	con.present();
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+	unsigned long long bytesBefore = ptyBytes;
+	long long writesBefore = writeSyscalls();
+	for (int frame = 0; frame < frames; ++frame) {
+		CLOCK::time_point start = CLOCK::now();
+		result.ops += scenario(con, frame);
+		CLOCK::time_point drawn = CLOCK::now();
+		con.present();
+		CLOCK::time_point presented = CLOCK::now();
+
+		result.drawNs += std::chrono::duration<double, std::nano>(drawn - start).count();
+		result.presentNs += std::chrono::duration<double, std::nano>(presented - drawn).count();
+	}
+	long long writesAfter = writeSyscalls();
+
+	//let the reader catch up with the last frame
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	result.bytes = ptyBytes - bytesBefore;
+	result.writes = writesBefore < 0 ? -1 : writesAfter - writesBefore;
+	return result;
+}
+
+int main(int argc, char** argv) {
+	int frames = argc > 1 ? atoi(argv[1]) : 300;
+	int width = argc > 2 ? atoi(argv[2]) : 120;
+	int height = argc > 3 ? atoi(argv[3]) : 40;
+
+	//the controller takes over stdin and stdout, so they become the pty and
+	//the results go to wherever stdout pointed before
+	winsize ws = {(unsigned short) height, (unsigned short) width, 0, 0};
+	int master, slave;
+	if (openpty(&master, &slave, NULL, NULL, &ws) != 0) {
+		perror("openpty");
+		return 1;
+	}
+	FILE* report = fdopen(dup(STDOUT_FILENO), "w");
+	dup2(slave, STDIN_FILENO);
+	dup2(slave, STDOUT_FILENO);
+	close(slave);
+	setenv("TERM", "xterm-256color", 0); //curses needs to know what it is talking to
+	std::thread reader(drainPty, master);
+
+	RESULT results[5];
+	{
+		ConsoleController con;
+		for (int i = 0; i < 8; ++i)
+			con.initColor(1 + i, i, COLOR_BLACK, i % 2, false);
+
+		results[0] = run(con, "full-screen random", fullScreenRandom, frames);
+		results[1] = run(con, "scrolling log", scrollingLog, frames);
+		results[2] = run(con, "sparse updates", sparseUpdates, frames);
+		results[3] = run(con, "color table", colorTable, frames);
+		results[4] = run(con, "cls and redraw", clearAndRedraw, frames);
+	}
+
+	fprintf(report, "%dx%d, %d frames per scenario\n\n", width, height, frames);
+	fprintf(report, "%-20s %10s %10s %12s %12s %12s\n",
+		"scenario", "calls/fr", "ns/call", "present us", "bytes/fr", "writes/fr");
+	for (int i = 0; i < 5; ++i) {
+		const RESULT& r = results[i];
+		fprintf(report, "%-20s %10.1f %10.1f %12.1f %12.1f ",
+			r.name, (double) r.ops / r.frames, r.drawNs / r.ops, r.presentNs / r.frames / 1000, (double) r.bytes / r.frames);
+		if (r.writes < 0)
+			fprintf(report, "%12s\n", "n/a");
+		else
+			fprintf(report, "%12.2f\n", (double) r.writes / r.frames);
+	}
+	fclose(report);
+
+	//closing our end of the pty ends the reader
+	close(STDIN_FILENO);
+	close(STDOUT_FILENO);
+	reader.join();
+	close(master);
+	return 0;
+}
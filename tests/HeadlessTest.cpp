@@ -0,0 +1,92 @@
+//Checks for ConsoleController, run against the headless backend so they need no terminal
+//Each check drives the controller through scripted input and the in-memory screen
+//
+//Build from the repository root:
+//  g++ -std=c++17 -DCONSOLECONTROLLER_HEADLESS -I. tests/HeadlessTest.cpp ConsoleController.cpp -pthread -o headlesstest
+//Run:
+//  ./headlesstest
+//Failures are listed on stderr and the exit status is the number of them
+//
+
+#include "ConsoleController.h"
+
+#include <cstdio> //results
+
+#ifndef CONSOLECONTROLLER_HEADLESS
+#error "build the checks with -DCONSOLECONTROLLER_HEADLESS"
+#endif
+
+static int failures = 0;
+
+//stderr, since the controller owns stdout
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) { \
+			fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #condition); \
+			++failures; \
+		} \
+	} while (0)
+
+static void lineInput() {
+	con.pushInput("hello\r");
+	CHECK(con.waitForInput() == "hello");
+	CHECK(con.getKey() == 0);
+}
+
+static void inputEndingWithoutDelimiter() {
+	//the script running out ends the line instead of waiting for a newline forever
+	con.pushInput("abc");
+	CHECK(con.waitForInput() == "abc");
+
+	con.pushInput("12,34");
+	CHECK(con.waitForInput(',') == "12"); //the rest of the line is skipped up to the end of the script
+	CHECK(con.getKey() == 0);
+}
+
+static void backspace() {
+	con.pushInput("ab");
+	con.pushKey('\b');
+	con.pushInput("c\r");
+	CHECK(con.waitForInput() == "ac");
+}
+
+static void keys() {
+	con.pushKey(ARROW_UP);
+	con.pushInput("\x1b[B");
+	CHECK(con.waitForKey() == ARROW_UP);
+	CHECK(con.waitForKey() == ARROW_DOWN);
+	CHECK(con.waitForKey() == 0);
+
+	con.pushInput("xyz");
+	con.waitForKey('y');
+	CHECK(con.getKey() == 'z');
+	con.waitForKey('q'); //never comes, so this has to give up at the end of the script
+	CHECK(con.getKey() == 0);
+}
+
+static void screen() {
+	con.cls();
+	con.moveCursor(2, 1);
+	con.output("hi \xe6\xbc\xa2"); //U+6F22, two columns wide
+	con.present();
+	CHECK(con.getGlyphAt(2, 1) == U'h');
+	CHECK(con.getGlyphAt(3, 1) == U'i');
+	CHECK(con.getGlyphAt(4, 1) == U' ');
+	CHECK(con.getGlyphAt(5, 1) == U'漢');
+	CHECK(con.getGlyphAt(6, 1) == 0);
+	CHECK(con.getCurPos().x == 7);
+}
+
+int main() {
+	con.setWindowSize(40, 10);
+
+	lineInput();
+	inputEndingWithoutDelimiter();
+	backspace();
+	keys();
+	screen();
+
+	if (failures == 0)
+		fprintf(stderr, "all checks passed\n");
+	return failures;
+}